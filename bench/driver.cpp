@@ -0,0 +1,655 @@
+/**
+ * End-to-end benchmark driver. Compresses and decompresses synthetic
+ * data in process over a grid of model parameters and outputs a JSON
+ * array with speed, cycles per byte, bpc, peak resident memory and
+ * counts of model resets and rescales for each run.
+ *
+ * Generator gives text-like, DNA-like or repetitive data from a seed,
+ * the same bytes for the same seed on every run, so scaling can be
+ * tested without a corpus. Data larger than the in-memory limit is
+ * generated while compressing and again while checking the output.
+ *
+ * With --messages the driver times short messages compressed from a
+ * snapshot primed with the start of the data instead, against the
+ * same messages compressed to frames from an empty model.
+ *
+ * @author jkataja
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <algorithm>
+#include <x86intrin.h>
+#include <boost/program_options.hpp>
+#include <boost/format.hpp>
+
+#include "../src/pompom.hpp"
+#include "prng.hpp"
+
+namespace po = boost::program_options;
+
+using namespace pompom;
+
+#define USAGE "Usage: pompom-bench [OPTION]...\n" \
+	"Benchmark compression and decompression of synthetic data over a grid\n" \
+	"of model parameters. Lists are comma separated. Outputs JSON.\n" \
+	"\n"
+
+// Length of generated chunks
+static const size_t ChunkLen = 65536;
+
+// Synthetic data of kind from seed
+class generator {
+public:
+	generator(const std::string&, const uint64);
+
+	// Next bytes of data
+	void fill(char *, const size_t);
+private:
+	enum { Text, DNA, Repetitive } kind;
+	prng r;
+
+	// Text: words and cumulative Zipf weights
+	std::vector<std::string> words;
+	std::vector<double> weights;
+	std::string pending;
+	size_t pendingp;
+	int sentence;
+
+	// DNA and repetitive: recent output for copies
+	std::vector<char> window;
+	size_t windowp;
+	uint64 copyp;
+	uint64 copylen;
+	uint8 last[2];
+
+	void put_window(const char);
+	const char text_byte();
+	const char dna_byte();
+	const char repetitive_byte();
+};
+
+generator::generator(const std::string& name, const uint64 seed)
+	: r(seed), pendingp(0), sentence(0), windowp(0), copyp(0), copylen(0)
+{
+	last[0] = last[1] = 0;
+	if (name == "text")
+		kind = Text;
+	else if (name == "dna")
+		kind = DNA;
+	else if (name == "repetitive")
+		kind = Repetitive;
+	else
+		throw std::range_error("unknown data kind " + name);
+
+	if (kind == Text) {
+		// Vocabulary with short words more common
+		static const char Letters[] = "etaoinshrdlcumwfgypbvkjxqz";
+		double sum = 0;
+		for (int i = 0 ; i < 4096 ; ++i) {
+			int n = 1 + (r.next() % 3) + (r.next() % (2 + i / 512));
+			std::string w;
+			for (int k = 0 ; k < n ; ++k) {
+				// Skewed letter frequency
+				uint64 v = r.next() % 26;
+				w += Letters[ (v * v) / 26 ];
+			}
+			words.push_back(w);
+			sum += 1.0 / (i + 1);
+			weights.push_back(sum);
+		}
+	}
+	else
+		window.resize(1 << 20, 0);
+}
+
+void generator::put_window(const char c) {
+	window[windowp] = c;
+	windowp = (windowp + 1) & (window.size() - 1);
+}
+
+const char generator::text_byte() {
+	while (pendingp >= pending.size()) {
+		// Zipf distributed word
+		double v = (r.next() >> 11) * (1.0 / 9007199254740992.0)
+			* weights.back();
+		size_t i = std::lower_bound(weights.begin(), weights.end(), v)
+			- weights.begin();
+		pending = words[ std::min(i, words.size() - 1) ];
+		if (sentence == 0)
+			pending[0] = toupper(pending[0]);
+		++sentence;
+		uint64 e = r.next() % 16;
+		if (sentence > 4 && e == 0) {
+			pending += ((r.next() & 3) == 0 ? ".\n" : ". ");
+			sentence = 0;
+		}
+		else if (e == 1)
+			pending += ", ";
+		else
+			pending += ' ';
+		pendingp = 0;
+	}
+	return pending[pendingp++];
+}
+
+const char generator::dna_byte() {
+	static const char Bases[] = "ACGT";
+	char c;
+	if (copylen > 0) {
+		// Copy of earlier sequence with point mutations
+		c = window[ copyp++ & (window.size() - 1) ];
+		--copylen;
+		if (r.next() % 64 == 0)
+			c = Bases[ r.next() & 3 ];
+	}
+	else {
+		// Start copy of earlier sequence sometimes
+		uint64 v = r.next();
+		if (v % 512 == 0) {
+			copylen = 64 + (v >> 32) % 2048;
+			copyp = windowp - 1 - ((v >> 12) % (window.size() - copylen));
+		}
+		// Base depends on two preceding bases
+		uint64 b = ((last[0] * 7 + last[1] * 3 + (v >> 40)) & 0xFF);
+		c = Bases[ (b < 96) ? (last[0] & 3) : (b & 3) ];
+	}
+	last[1] = last[0];
+	last[0] = c;
+	put_window(c);
+	return c;
+}
+
+const char generator::repetitive_byte() {
+	char c;
+	if (copylen == 0) {
+		uint64 v = r.next();
+		copylen = 16 + v % 4096;
+		// Mostly copies from recent output, sometimes new random run
+		if ((v >> 20) % 8 == 0)
+			copyp = ~0ULL;
+		else
+			copyp = windowp - 1 - ((v >> 32) % 65536);
+	}
+	--copylen;
+	if (copyp == ~0ULL)
+		c = (char)(r.next() & 0x7F);
+	else
+		c = window[ copyp++ & (window.size() - 1) ];
+	put_window(c);
+	return c;
+}
+
+void generator::fill(char * buf, const size_t n) {
+	for (size_t i = 0 ; i < n ; ++i) {
+		switch (kind) {
+			case Text: buf[i] = text_byte(); break;
+			case DNA: buf[i] = dna_byte(); break;
+			case Repetitive: buf[i] = repetitive_byte(); break;
+		}
+	}
+}
+
+// Input stream buffer of generated data or data in memory
+class source_buf : public std::streambuf {
+public:
+	source_buf(const std::string& kind, const uint64 seed, const uint64 n)
+		: gen(new generator(kind, seed)), data(0), left(n), chunk(ChunkLen) {}
+	source_buf(const std::string& d)
+		: data(&d), left(0)
+	{
+		char * b = const_cast<char *>(d.data());
+		setg(b, b, b + d.size());
+	}
+protected:
+	int_type underflow() {
+		if (data || left == 0)
+			return traits_type::eof();
+		size_t n = std::min((uint64)chunk.size(), left);
+		gen->fill(&chunk[0], n);
+		left -= n;
+		setg(&chunk[0], &chunk[0], &chunk[0] + n);
+		return traits_type::to_int_type(chunk[0]);
+	}
+private:
+	std::unique_ptr<generator> gen;
+	const std::string * data;
+	uint64 left;
+	std::vector<char> chunk;
+};
+
+// Output stream buffer appending to string
+class append_buf : public std::streambuf {
+public:
+	append_buf(std::string& proxy) : out(proxy) {}
+protected:
+	int_type overflow(int_type c) {
+		if (c != traits_type::eof())
+			out.push_back(traits_type::to_char_type(c));
+		return c;
+	}
+	std::streamsize xsputn(const char * p, std::streamsize n) {
+		out.append(p, n);
+		return n;
+	}
+private:
+	std::string& out;
+};
+
+// Output stream buffer comparing against the original data
+class check_buf : public std::streambuf {
+public:
+	check_buf(std::istream& proxy) : orig(proxy), len(0), same(true) {}
+	const bool matches() { return same && orig.peek() == EOF; }
+	const uint64 length() const { return len; }
+protected:
+	int_type overflow(int_type c) {
+		if (c != traits_type::eof()) {
+			char b = traits_type::to_char_type(c);
+			xsputn(&b, 1);
+		}
+		return c;
+	}
+	std::streamsize xsputn(const char * p, std::streamsize n) {
+		std::streamsize done = 0;
+		while (same && done < n) {
+			char buf[ ChunkLen ];
+			std::streamsize k = std::min((std::streamsize)ChunkLen, n - done);
+			if (orig.read(buf, k).gcount() != k
+					|| memcmp(buf, p + done, k) != 0)
+				same = false;
+			done += k;
+		}
+		len += n;
+		return n;
+	}
+private:
+	std::istream& orig;
+	uint64 len;
+	bool same;
+};
+
+// Resident memory high water mark in KiB, reset when asked
+static uint64 peak_rss(const bool reset) {
+	if (reset) {
+		// Since Linux 4.0
+		std::ofstream clear("/proc/self/clear_refs");
+		clear << "5" << std::flush;
+		return 0;
+	}
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line))
+		if (line.compare(0, 6, "VmHWM:") == 0)
+			return strtoull(line.c_str() + 6, 0, 10);
+	return 0;
+}
+
+// Comma separated list of integers
+static std::vector<int> int_list(const std::string& s) {
+	std::vector<int> v;
+	std::string part;
+	std::istringstream parts(s);
+	while (std::getline(parts, part, ','))
+		v.push_back(atoi(part.c_str()));
+	return v;
+}
+
+// Comma separated list of words
+static std::vector<std::string> word_list(const std::string& s) {
+	std::vector<std::string> v;
+	std::string part;
+	std::istringstream parts(s);
+	while (std::getline(parts, part, ','))
+		v.push_back(part);
+	return v;
+}
+
+// Length with optional K, M or G suffix
+static uint64 size_arg(const std::string& s) {
+	char * end = 0;
+	uint64 n = strtoull(s.c_str(), &end, 10);
+	static const char Suffixes[] = "KMG";
+	const char * suffix = (*end != 0 ? strchr(Suffixes, toupper(*end)) : 0);
+	if (suffix != 0)
+		n <<= (10 * (suffix - Suffixes + 1));
+	return n;
+}
+
+// Seconds and cycles of a run
+class measure {
+public:
+	measure() : start(std::chrono::steady_clock::now()), tsc(__rdtsc()) {}
+	const double seconds() const {
+		return std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - start).count();
+	}
+	const uint64 cycles() const {
+		return __rdtsc() - tsc;
+	}
+private:
+	std::chrono::steady_clock::time_point start;
+	uint64 tsc;
+};
+
+// Run compression and decompression of data with options as JSON object
+static void run(std::ostream& json, const std::string& kind,
+		const uint64 seed, const uint64 size, const std::string * data,
+		const options& opt)
+{
+	std::ostream null(0);
+	stats cst;
+	stats dst;
+
+	// Compress
+	std::string code;
+	peak_rss(true);
+	long len;
+	double csec;
+	uint64 ccycles;
+	{
+		std::unique_ptr<source_buf> src( data ? new source_buf(*data)
+				: new source_buf(kind, seed, size) );
+		std::istream in(src.get());
+		append_buf buf(code);
+		std::ostream out(&buf);
+		measure m;
+		len = compress(in, out, null, opt, cst);
+		csec = m.seconds();
+		ccycles = m.cycles();
+	}
+	uint64 crss = peak_rss(false);
+
+	// Decompress and check against original
+	peak_rss(true);
+	long dlen;
+	double dsec;
+	uint64 dcycles;
+	bool ok;
+	{
+		std::unique_ptr<source_buf> src( data ? new source_buf(*data)
+				: new source_buf(kind, seed, size) );
+		std::istream orig(src.get());
+		check_buf buf(orig);
+		std::ostream out(&buf);
+		std::istringstream in(code);
+		measure m;
+		dlen = decompress(in, out, null, dst);
+		dsec = m.seconds();
+		dcycles = m.cycles();
+		ok = (dlen == len && buf.matches());
+	}
+	uint64 drss = peak_rss(false);
+
+	double mb = len / 1e6;
+	json << std::fixed << std::setprecision(3)
+		<< "{\"kind\":\"" << kind << "\",\"seed\":" << seed
+		<< ",\"size\":" << len << ",\"streamed\":" << (data ? "false" : "true")
+		<< ",\"order\":" << opt.order << ",\"mem\":" << opt.limit
+		<< ",\"adapt\":" << (opt.adapt ? opt.adaptsize : 0)
+		<< ",\"bootsize\":" << (opt.reset ? 0 : opt.bootsize)
+		<< ",\"match\":" << (opt.longmatch ? 1 : 0)
+		<< ",\"skip\":" << (opt.skip ? 1 : 0)
+		<< ",\"fingerprint\":" << (opt.fingerprint ? 1 : 0)
+		<< ",\"split\":" << opt.split
+		<< ",\"engine\":" << opt.engine
+		<< ",\"dedup\":" << opt.dedupsize
+		<< ",\"compressed\":" << code.size()
+		<< ",\"bpc\":" << (len > 0 ? (code.size() * 8.0 / len) : 0.0)
+		<< ",\"compress\":{\"seconds\":" << csec
+		<< ",\"mb_s\":" << (mb / csec)
+		<< ",\"cycles_byte\":" << (len > 0 ? (double)ccycles / len : 0.0)
+		<< ",\"peak_rss_kib\":" << crss
+		<< ",\"stats\":";
+	report(json, cst);
+	json
+		<< "},\"decompress\":{\"seconds\":" << dsec
+		<< ",\"mb_s\":" << (mb / dsec)
+		<< ",\"cycles_byte\":" << (len > 0 ? (double)dcycles / len : 0.0)
+		<< ",\"peak_rss_kib\":" << drss
+		<< ",\"stats\":";
+	report(json, dst);
+	json
+		<< "},\"ok\":" << (ok ? "true" : "false") << "}";
+}
+
+// Run messages of length from data after priming part as JSON object
+static void run_messages(std::ostream& json, const std::string& kind,
+		const uint64 seed, const std::string& data, const size_t primelen,
+		const size_t msglen, const int count, const options& opt)
+{
+	std::ostream null(0);
+
+	measure p;
+	std::string primer(data, 0, primelen);
+	std::istringstream primein(primer);
+	std::shared_ptr<const snapshot> s = prime(primein, opt);
+	const double psec = p.seconds();
+
+	// Messages are spread over data after priming part
+	const size_t span = (data.size() - primelen) / count;
+	double wsec = 0, dsec = 0, csec = 0;
+	uint64 wlen = 0, clen = 0, len = 0;
+	bool ok = true;
+	for (int i = 0 ; i < count ; ++i) {
+		const char * msg = data.data() + primelen + i * span;
+
+		// Warm: from snapshot
+		std::string code;
+		measure w;
+		compress(*s, msg, msglen, code);
+		wsec += w.seconds();
+
+		std::string back;
+		measure d;
+		const long n = decompress(*s, code.data(), code.size(), back);
+		dsec += d.seconds();
+		ok = (ok && n == (long)msglen && back.compare(0, msglen, msg, msglen) == 0);
+
+		// Cold: frame from empty model
+		std::istringstream in(std::string(msg, msglen));
+		std::string frame;
+		append_buf buf(frame);
+		std::ostream out(&buf);
+		measure c;
+		compress(in, out, null, opt);
+		csec += c.seconds();
+
+		wlen += code.size();
+		clen += frame.size();
+		len += msglen;
+	}
+
+	json << std::fixed << std::setprecision(3)
+		<< "{\"kind\":\"" << kind << "\",\"seed\":" << seed
+		<< ",\"prime\":" << primelen << ",\"message\":" << msglen
+		<< ",\"count\":" << count
+		<< ",\"order\":" << opt.order << ",\"mem\":" << opt.limit
+		<< ",\"engine\":" << opt.engine
+		<< ",\"prime_ms\":" << (psec * 1e3)
+		<< ",\"warm\":{\"compress_us\":" << (wsec / count * 1e6)
+		<< ",\"decompress_us\":" << (dsec / count * 1e6)
+		<< ",\"bpc\":" << (wlen * 8.0 / len)
+		<< "},\"cold\":{\"compress_us\":" << (csec / count * 1e6)
+		<< ",\"bpc\":" << (clen * 8.0 / len)
+		<< "},\"ok\":" << (ok ? "true" : "false") << "}";
+}
+
+int main(int argc, char** argv) {
+	setlocale(LC_ALL,"C");
+
+	try {
+		po::options_description args("Options");
+		args.add_options()
+			( "help,h", "show this help" )
+			( "kind,k", po::value<std::string>()->default_value("text"),
+				"data kinds: text, dna, repetitive" )
+			( "size,s", po::value<std::string>()->default_value("1M"),
+				"data lengths with suffix K, M or G" )
+			( "seed", po::value<uint64>()->default_value(1),
+				"generator seed" )
+			( "order,o", po::value<std::string>()->default_value(
+				boost::str(boost::format("%1%") % OrderDefault)),
+				"model orders" )
+			( "mem,m", po::value<std::string>()->default_value(
+				boost::str(boost::format("%1%") % LimitDefault)),
+				"memory limits in MiB" )
+			( "adapt,a", po::value<std::string>()->default_value("0"),
+				"adaptation thresholds in bits (0 is no adaptation)" )
+			( "bootsize,b", po::value<std::string>()->default_value(
+				boost::str(boost::format("%1%") % BootDefault)),
+				"bootstrap buffer sizes in KiB (0 is reset)" )
+			( "match,M", po::value<std::string>()->default_value("0"),
+				"long-match model (0 is off, 1 is on)" )
+			( "skip", po::value<std::string>()->default_value("0"),
+				"start order skipping (0 is off, 1 is on)" )
+			( "fingerprint", po::value<std::string>()->default_value("0"),
+				"16-bit key fingerprints (0 is off, 1 is on)" )
+			( "split", po::value<std::string>()->default_value("0"),
+				"context tables by length (0 is shared, 1 even, 2 rising)" )
+			( "engine", po::value<std::string>()->default_value("0"),
+				"coding engines (0 is PPM, 1 is binary mixing, 2 is fast)" )
+			( "dedup", po::value<std::string>()->default_value("0"),
+				"deduplication windows in MiB (0 is off)" )
+			( "inmem", po::value<std::string>()->default_value("512M"),
+				"generate data up to length before timing" )
+			( "messages", po::value<std::string>(),
+				"time messages of lengths from primed snapshot" )
+			( "prime", po::value<std::string>()->default_value("150K"),
+				"length of data to prime snapshot for messages" )
+			( "count", po::value<int>()->default_value(50),
+				"count of messages of each length" )
+			( "generate,g", "write data of first kind and size to stdout" )
+		;
+		po::variables_map vm;
+		po::store(po::parse_command_line(argc, argv, args), vm);
+		po::notify(vm);
+
+		if (vm.count("help")) {
+			std::cout << USAGE << args << std::endl;
+			return EXIT_SUCCESS;
+		}
+
+		const std::vector<std::string> kinds =
+			word_list(vm["kind"].as<std::string>());
+		const std::vector<std::string> sizes =
+			word_list(vm["size"].as<std::string>());
+		const uint64 seed = vm["seed"].as<uint64>();
+		const uint64 inmem = size_arg(vm["inmem"].as<std::string>());
+
+		// Corpus for other tools
+		if (vm.count("generate")) {
+			uint64 left = size_arg(sizes.at(0));
+			generator gen(kinds.at(0), seed);
+			std::vector<char> buf(ChunkLen);
+			while (left > 0) {
+				size_t n = std::min((uint64)ChunkLen, left);
+				gen.fill(&buf[0], n);
+				std::cout.write(&buf[0], n);
+				left -= n;
+			}
+			return (std::cout.flush() ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+
+		const std::vector<int> orders = int_list(vm["order"].as<std::string>());
+		const std::vector<int> mems = int_list(vm["mem"].as<std::string>());
+		const std::vector<int> adapts = int_list(vm["adapt"].as<std::string>());
+		const std::vector<int> boots = int_list(vm["bootsize"].as<std::string>());
+		const std::vector<int> matches = int_list(vm["match"].as<std::string>());
+		const std::vector<int> skips = int_list(vm["skip"].as<std::string>());
+		const std::vector<int> fingerprints = 
+			int_list(vm["fingerprint"].as<std::string>());
+		const std::vector<int> splits = int_list(vm["split"].as<std::string>());
+		const std::vector<int> engines = 
+			int_list(vm["engine"].as<std::string>());
+		const std::vector<int> dedups = int_list(vm["dedup"].as<std::string>());
+
+		// Latency of messages from snapshot
+		if (vm.count("messages")) {
+			const std::vector<std::string> lens =
+				word_list(vm["messages"].as<std::string>());
+			const size_t primelen = size_arg(vm["prime"].as<std::string>());
+			const int count = std::max(1, vm["count"].as<int>());
+			bool first = true;
+			std::cout << "[" << std::endl;
+			for (auto k = kinds.begin() ; k != kinds.end() ; ++k) {
+				for (auto l = lens.begin() ; l != lens.end() ; ++l) {
+					const size_t msglen = size_arg(*l);
+					std::string data(primelen + (msglen << 1) * count, 0);
+					generator gen(*k, seed);
+					gen.fill(&data[0], data.size());
+					for (auto o : orders) for (auto m : mems)
+					for (auto e : engines) {
+						options opt;
+						opt.order = o;
+						opt.limit = m;
+						opt.engine = e;
+						if (!first)
+							std::cout << "," << std::endl;
+						first = false;
+						run_messages(std::cout, *k, seed, data, primelen, 
+								msglen, count, opt);
+						std::cout << std::flush;
+					}
+				}
+			}
+			std::cout << std::endl << "]" << std::endl;
+			return EXIT_SUCCESS;
+		}
+
+		bool first = true;
+		std::cout << "[" << std::endl;
+		for (auto k = kinds.begin() ; k != kinds.end() ; ++k) {
+			for (auto s = sizes.begin() ; s != sizes.end() ; ++s) {
+				uint64 size = size_arg(*s);
+				std::unique_ptr<std::string> data;
+				if (size <= inmem) {
+					data.reset(new std::string(size, 0));
+					generator gen(*k, seed);
+					gen.fill(&(*data)[0], size);
+				}
+				for (auto o : orders) for (auto m : mems)
+				for (auto a : adapts) for (auto b : boots)
+				for (auto x : matches) for (auto y : skips)
+				for (auto g : fingerprints)
+				for (auto p : splits) for (auto e : engines)
+				for (auto d : dedups) {
+					options opt;
+					opt.order = o;
+					opt.limit = m;
+					opt.adapt = (a > 0);
+					if (a > 0)
+						opt.adaptsize = a;
+					opt.reset = (b == 0);
+					if (b > 0)
+						opt.bootsize = b;
+					opt.longmatch = (x > 0);
+					opt.skip = (y > 0);
+					opt.fingerprint = (g > 0);
+					opt.split = p;
+					opt.engine = e;
+					opt.dedupsize = d;
+					if (!first)
+						std::cout << "," << std::endl;
+					first = false;
+					run(std::cout, *k, seed, size, data.get(), opt);
+					std::cout << std::flush;
+				}
+			}
+		}
+		std::cout << std::endl << "]" << std::endl;
+	}
+	catch (std::exception& e) {
+		std::cerr << SELF << ": " << e.what() << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
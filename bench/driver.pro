@@ -0,0 +1,8 @@
+TEMPLATE = app
+CONFIG = console warn_on release
+SOURCES = driver.cpp ../src/pompom.cpp
+TARGET = pompom-bench
+DESTDIR = ../bin
+LIBS = -lboost_program_options -lboost_system -lpthread -lm
+
+include(../common.pri)
@@ -0,0 +1,376 @@
+/**
+ * Microbenchmarks for the hot paths: cuckoo hash operations at different
+ * load factors, model distribution and update per order, encoder and
+ * decoder, long-match model, and startup latency of a model with large
+ * memory limit for short inputs. Inputs are synthetic and generated from
+ * a fixed seed, so runs are comparable between builds. Results are in
+ * nanoseconds and in time stamp counter cycles per operation.
+ *
+ * @author jkataja
+ */
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <algorithm>
+#include <x86intrin.h>
+#include <boost/format.hpp>
+
+#include "../src/pompom.hpp"
+#include "../src/cuckoo.hpp"
+#include "../src/model.hpp"
+#include "../src/match.hpp"
+#include "../src/encoder.hpp"
+#include "../src/decoder.hpp"
+#include "prng.hpp"
+
+using namespace pompom;
+
+// Memory limit in MiB for cuckoo benchmarks
+static const int BenchLimit = 32;
+
+// Operations per measurement
+static const int BenchOps = 200000;
+
+// Memory limit in MiB for startup benchmark
+static const int StartupLimit = 512;
+
+// Text-like input: skewed symbol frequencies with repeated words
+static std::string synthetic_text(const size_t n, const uint64 seed) {
+	static const char * words[] = { "the ", "of ", "and ", "model ", "context ",
+		"order ", "hash ", "frequency ", "symbol ", "escape ", "code ", "range ",
+		"table ", "count ", "bit ", "vector ", "\n" };
+	const int nwords = sizeof(words) / sizeof(words[0]);
+	prng r(seed);
+	std::string s;
+	s.reserve(n);
+	while (s.size() < n) {
+		uint64 v = r.next();
+		// Mostly common words, sometimes random letters
+		if ((v & 7) != 0)
+			s += words[(v >> 8) % nwords];
+		else
+			s += (char)('a' + (v >> 16) % 26);
+	}
+	s.resize(n);
+	return s;
+}
+
+// Cuckoo key of context length and context bytes
+static uint64 random_key(prng& r) {
+	uint64 ord = 1 + r.next() % TextOrderMax;
+	uint64 ctx = r.next() & ((1ULL << (8 * (ord + 1))) - 1);
+	return ((0x80ULL + ord) << 56) | ctx;
+}
+
+// Time and cycles of a measurement
+class measure {
+public:
+	measure(const std::string& label) : name(label) {
+		start = std::chrono::steady_clock::now();
+		tsc = __rdtsc();
+	}
+	void stop(const uint64 ops) {
+		uint64 cycles = __rdtsc() - tsc;
+		double ns = std::chrono::duration<double, std::nano>(
+				std::chrono::steady_clock::now() - start).count();
+		std::cout << std::left << std::setw(36) << name << std::right
+			<< std::fixed << std::setprecision(1)
+			<< std::setw(10) << (ns / ops) << " ns/op"
+			<< std::setw(10) << ((double)cycles / ops) << " cycles/op"
+			<< std::endl;
+	}
+private:
+	std::string name;
+	std::chrono::steady_clock::time_point start;
+	uint64 tsc;
+};
+
+// Output time and cycles summed over calls
+static void report(const std::string& name, 
+		const std::chrono::steady_clock::duration t, const uint64 cycles,
+		const uint64 ops)
+{
+	std::cout << std::left << std::setw(36) << name << std::right
+		<< std::fixed << std::setprecision(1)
+		<< std::setw(10)
+		<< (std::chrono::duration<double, std::nano>(t).count() / ops)
+		<< " ns/op" << std::setw(10) << ((double)cycles / ops)
+		<< " cycles/op" << std::endl;
+}
+
+// Discards output
+class null_buf : public std::streambuf {
+protected:
+	int_type overflow(int_type c) { return c; }
+	std::streamsize xsputn(const char *, std::streamsize n) { return n; }
+};
+
+// Keep result from being optimized away
+static volatile uint64 sink;
+
+static void bench_cuckoo() {
+	static const int Loads[] = { 10, 25, 40, 48 };
+	for (size_t l = 0 ; l < sizeof(Loads) / sizeof(Loads[0]) ; ++l) {
+		cuckoo table((size_t)BenchLimit << 20, false, false);
+		prng r(1);
+
+		// Fill to load factor; slots are keys+values+followers+vectors
+		size_t len = (BenchLimit << 20) / (8 + 2 + 4 + 16);
+		size_t target = len * Loads[l] / 100;
+		std::vector<uint64> present;
+		present.reserve(target);
+		while (present.size() < target) {
+			uint64 key = random_key(r);
+			if (!table.insert(key))
+				break;
+			present.push_back(key);
+		}
+		if (table.full())
+			std::cout << "cuckoo filled before load factor " << Loads[l]
+				<< "%" << std::endl;
+
+		std::ostringstream label;
+		label << "load " << Loads[l] << "% ";
+
+		// Count of present keys
+		uint64 v = 0;
+		measure hit(label.str() + "cuckoo::count hit");
+		for (int i = 0 ; i < BenchOps ; ++i)
+			v += table.count(present[r.next() % present.size()]);
+		hit.stop(BenchOps);
+
+		// Count of missing keys
+		measure miss(label.str() + "cuckoo::count miss");
+		for (int i = 0 ; i < BenchOps ; ++i)
+			v += table.count(random_key(r) ^ 1);
+		miss.stop(BenchOps);
+		sink = v;
+
+		// Increase frequency of present keys
+		measure seen(label.str() + "cuckoo::seen");
+		for (int i = 0 ; i < BenchOps ; ++i) {
+			uint64 key = present[r.next() % present.size()];
+			table.seen(key);
+		}
+		seen.stop(BenchOps);
+
+		// Insert new keys at load factor; 1% of table keeps load near
+		int n = std::min((size_t)BenchOps, len / 100);
+		std::vector<uint64> fresh;
+		for (int i = 0 ; i < n ; ++i)
+			fresh.push_back(random_key(r));
+		measure insert(label.str() + "cuckoo::insert");
+		int i = 0;
+		for ( ; i < n && table.insert(fresh[i]) ; ++i)
+			;
+		insert.stop(std::max(i, 1));
+	}
+}
+
+static void bench_model() {
+	const std::string text = synthetic_text(1 << 20, 2);
+	uint32 dist[ R(EOS) + 1 ];
+	uint64 x_mask[4];
+
+	for (int order = OrderMin ; order <= OrderMax ; ++order) {
+		std::unique_ptr<model> m( model::instance(order, BenchLimit,
+				false, BootDefault, false, AdaptDefault, false, false, false, true,
+				false, SplitShared, EnginePPM) );
+
+		// Warm with first half of text
+		size_t half = text.size() >> 1;
+		for (size_t p = 0 ; p < half ; ++p) {
+			memset(x_mask, 0xFF, sizeof(x_mask));
+			for (int ord = order ; ord >= -1 ; --ord) {
+				m->dist(ord, dist, x_mask);
+				uint8 c = text[p];
+				if (dist[ L(c) ] != dist[ R(c) ])
+					break;
+			}
+			m->update((uint8)text[p]);
+		}
+
+		std::ostringstream label;
+		label << "order " << order << " ";
+
+		// Distribution of highest order context while model advances
+		// over text with update outside of timing; timer overhead of
+		// each call is measured and subtracted
+		int n = std::min((size_t)BenchOps, (text.size() - half) >> 1);
+		std::chrono::steady_clock::duration t(0);
+		uint64 cycles = 0;
+		for (int i = 0 ; i < n ; ++i) {
+			auto t0 = std::chrono::steady_clock::now();
+			uint64 c0 = __rdtsc();
+			cycles -= __rdtsc() - c0;
+			t -= std::chrono::steady_clock::now() - t0;
+		}
+		for (int i = 0 ; i < n ; ++i) {
+			memset(x_mask, 0xFF, sizeof(x_mask));
+			auto t0 = std::chrono::steady_clock::now();
+			uint64 c0 = __rdtsc();
+			m->dist(order, dist, x_mask);
+			cycles += __rdtsc() - c0;
+			t += std::chrono::steady_clock::now() - t0;
+			uint8 c = text[half + i];
+			for (int ord = order - 1 ; dist[ L(c) ] == dist[ R(c) ] 
+					&& ord >= -1 ; --ord)
+				m->dist(ord, dist, x_mask);
+			m->update(c);
+		}
+		report(label.str() + "model::dist", t, cycles, n);
+
+		// Update after escapes down to coded symbol
+		t = std::chrono::steady_clock::duration(0);
+		cycles = 0;
+		for (int i = 0 ; i < n ; ++i) {
+			auto t0 = std::chrono::steady_clock::now();
+			uint64 c0 = __rdtsc();
+			cycles -= __rdtsc() - c0;
+			t -= std::chrono::steady_clock::now() - t0;
+		}
+		for (int i = 0 ; i < n ; ++i) {
+			uint8 c = text[half + n + i];
+			memset(x_mask, 0xFF, sizeof(x_mask));
+			for (int ord = order ; ord >= -1 ; --ord) {
+				m->dist(ord, dist, x_mask);
+				if (dist[ L(c) ] != dist[ R(c) ])
+					break;
+			}
+			auto t0 = std::chrono::steady_clock::now();
+			uint64 c0 = __rdtsc();
+			m->update(c);
+			cycles += __rdtsc() - c0;
+			t += std::chrono::steady_clock::now() - t0;
+		}
+		report(label.str() + "model::update", t, cycles, n);
+	}
+}
+
+// Skewed distribution like a mid order context with escape
+static void synthetic_dist(uint32 * dist) {
+	uint32 run = 0;
+	dist[0] = 0;
+	for (int c = 0 ; c <= Alpha ; ++c) {
+		run += ((c >= 'a' && c <= 'z') ? (1 + ((c * 7) % 31)) : 0);
+		dist[ R(c) ] = run;
+	}
+	dist[ R(Escape) ] = dist[ R(EOS) ] = run + 26;
+}
+
+static void bench_coder() {
+	uint32 dist[ R(EOS) + 1 ];
+	synthetic_dist(dist);
+
+	// Symbols which have frequency in distribution
+	prng r(3);
+	std::vector<uint16> syms;
+	for (int i = 0 ; i < BenchOps ; ++i) {
+		uint64 v = r.next();
+		syms.push_back(((v & 15) == 0) ? Escape : ('a' + (v >> 8) % 26));
+	}
+
+	{
+		null_buf nb;
+		std::ostream out(&nb);
+		encoder enc(out);
+		measure e("encoder::encode");
+		for (int i = 0 ; i < BenchOps ; ++i)
+			enc.encode(syms[i], dist);
+		e.stop(BenchOps);
+		enc.finish();
+	}
+
+	std::ostringstream code;
+	{
+		encoder enc(code);
+		for (int i = 0 ; i < BenchOps ; ++i)
+			enc.encode(syms[i], dist);
+		enc.finish();
+	}
+	std::istringstream in(code.str());
+	decoder dec(in);
+	uint64 v = 0;
+	measure d("decoder::decode");
+	for (int i = 0 ; i < BenchOps ; ++i)
+		v += dec.decode(dist);
+	d.stop(BenchOps);
+	sink = v;
+}
+
+static void bench_match() {
+	// Text repeated with a small edit every 4 KiB
+	std::string text = synthetic_text(1 << 18, 4);
+	std::string data;
+	for (int i = 0 ; i < 4 ; ++i) {
+		std::string copy = text;
+		for (size_t p = i ; p < copy.size() ; p += 4096)
+			copy[p] = '#';
+		data += copy;
+	}
+
+	match mm(BenchLimit);
+	uint64 v = 0;
+	measure u("match::update");
+	for (size_t i = 0 ; i < data.size() ; ++i) {
+		v += mm.predicted();
+		mm.update((uint8)data[i]);
+	}
+	u.stop(data.size());
+	sink = v;
+}
+
+static void bench_startup() {
+	static const size_t Sizes[] = { 256, 4096, 65536, 1 << 20 };
+	const std::string text = synthetic_text(1 << 20, 5);
+	uint32 dist[ R(EOS) + 1 ];
+	uint64 x_mask[4];
+
+	// Model allocated, input modelled and model freed per byte
+	for (int grow = 0 ; grow <= 1 ; ++grow) {
+		for (size_t s = 0 ; s < sizeof(Sizes) / sizeof(Sizes[0]) ; ++s) {
+			std::ostringstream label;
+			label << "startup " << (grow ? "growing " : "fixed ") 
+				<< (Sizes[s] >> 10 ? Sizes[s] >> 10 : Sizes[s])
+				<< (Sizes[s] >> 10 ? "K" : "") << " per byte";
+			measure d(label.str());
+			std::unique_ptr<model> m( model::instance(OrderDefault,
+					StartupLimit, false, BootDefault, false, AdaptDefault,
+					false, false, false, grow, false, SplitShared,
+					EnginePPM) );
+			for (size_t p = 0 ; p < Sizes[s] ; ++p) {
+				uint8 c = text[p];
+				memset(x_mask, 0xFF, sizeof(x_mask));
+				for (int ord = m->start() ; ord >= -1 ; --ord) {
+					m->dist(ord, dist, x_mask);
+					if (dist[ L(c) ] != dist[ R(c) ])
+						break;
+				}
+				m->update(c);
+			}
+			m.reset();
+			d.stop(Sizes[s]);
+		}
+	}
+}
+
+int main(int argc, char ** argv) {
+	std::string only = (argc > 1 ? argv[1] : "");
+	if (only.empty() || only == "cuckoo")
+		bench_cuckoo();
+	if (only.empty() || only == "model")
+		bench_model();
+	if (only.empty() || only == "coder")
+		bench_coder();
+	if (only.empty() || only == "match")
+		bench_match();
+	if (only.empty() || only == "startup")
+		bench_startup();
+	return 0;
+}
@@ -0,0 +1,8 @@
+TEMPLATE = app
+CONFIG = console warn_on release
+SOURCES = micro.cpp
+TARGET = pompom-micro
+DESTDIR = ../bin
+LIBS = -lm
+
+include(../common.pri)
@@ -0,0 +1,31 @@
+/**
+ * Deterministic pseudo-random numbers (xorshift64*) for synthetic
+ * benchmark inputs, the same sequence for the same seed on every run.
+ *
+ * @see Vigna, S. (2014) An experimental exploration of Marsaglia's
+ *      xorshift generators, scrambled, arXiv:1402.6246
+ * @author jkataja
+ */
+
+#pragma once
+
+#include "../src/pompomdefs.hpp"
+
+namespace pompom {
+
+class prng {
+public:
+	// State must not be zero
+	prng(const uint64 seed) : x(seed ? seed : 1) {}
+
+	uint64 next() {
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		return x * 2685821657736338717ULL;
+	}
+private:
+	uint64 x;
+};
+
+} // namespace
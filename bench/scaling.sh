@@ -0,0 +1,29 @@
+#!/bin/sh
+#
+# Scaling of compression with memory limit from 2 GiB to 32 GiB on
+# streamed synthetic data. Limits larger than available memory are
+# left out. Data length is SIZE (default 4G) and other arguments are
+# passed to pompom-bench, ex. SIZE=16G bench/scaling.sh -k dna
+#
+# @author jkataja
+
+BENCH=`dirname $0`/../bin/pompom-bench
+
+# Available memory in MiB
+avail=`awk '/^MemAvailable:/ { print int($2 / 1024) }' /proc/meminfo`
+
+mems=""
+for m in 2048 4096 8192 16384 32768 ; do
+	if [ $m -lt $avail ] ; then
+		mems="$mems${mems:+,}$m"
+	else
+		echo "skipping limit $m MiB, available $avail MiB" >&2
+	fi
+done
+
+if [ -z "$mems" ] ; then
+	echo "not enough memory for 2 GiB limit" >&2
+	exit 1
+fi
+
+exec $BENCH -k text -s ${SIZE:-4G} -o 6 --inmem 0 -m $mems "$@"
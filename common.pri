@@ -22,6 +22,8 @@ QMAKE_CXXFLAGS += -std=c++0x \
 	-DUNSAFE \
 	# debugging
 	#-DDEBUG \
+	# hot path counters for --stats
+	#-DSTATS \
 	# rescaled frequency is at min 1
 	#-DRESCALE_MIN_1
 
@@ -214,15 +214,68 @@ END
 END
 }
 
+# Compress whole set with one process per file, with many files per
+# process and to one archive; output LaTeX tabular of total time and bpc
+sub run_files_tests {
+	my ($bin, $corpuspath, $collection, $arg) = @_;
+	my @files = map { "$corpuspath/$_" } @$collection;
+	s/\/\//\//g foreach @files;
+	my $quoted = join ' ', map { "'$_'" } @files;
+	my $origsizesum = 0;
+	$origsizesum += -s $_ foreach @files;
+	my $tmpdir = tempdir( CLEANUP => 1 );
+	my $archive = "$tmpdir/set.pim";
+	my @modes = (
+		[ 'process per file', 
+			join('; ', map { "'$bin' $arg < '$_' > '$_.pim'" } @files),
+			join('; ', map { "'$bin' -d < '$_.pim' > '$_.$SuffixFlip'" } @files),
+			sub { my $n = 0; $n += -s "$_.pim" foreach @files; return $n; } ],
+		[ 'files', 
+			"'$bin' $arg $quoted",
+			"cd '$tmpdir' && cp ".join(' ', map { "'$_.pim'" } @files)." . "
+				."&& '$bin' -d *.pim",
+			sub { my $n = 0; $n += -s "$_.pim" foreach @files; return $n; } ],
+		[ 'archive', 
+			"'$bin' $arg --archive '$archive' $quoted",
+			"cd '$tmpdir' && '$bin' -d < '$archive' > '$tmpdir/set.flip'",
+			sub { return -s $archive; } ],
+	);
+
+	print <<END;
+\\begin{tabular}[t]{|l|ll|}
+    \\hline
+           Mode & bpc & Time \\\\
+    \\hline
+END
+	foreach my $mode (@modes) {
+		my ($name, $full_c, $full_d, $sizef) = @$mode;
+		print STDERR "\tRunning '$name' options '$arg'\n";
+		my $start = [ Time::HiRes::gettimeofday( ) ];
+		system("( $full_c ) 2>/dev/null");
+		die "Command '$full_c' returned error\n" if ($? != 0 );
+		system("( $full_d ) 2>/dev/null");
+		die "Command '$full_d' returned error\n" if ($? != 0 );
+		my $time = Time::HiRes::tv_interval( $start );
+		my $bpc = (&$sizef() / $origsizesum) * 8.0;
+		unlink(map { ("$_.pim", "$_.$SuffixFlip") } @files);
+		printf "           %s & %.3f & %s \\\\\n", $name, $bpc, &pretty_time($time);
+	}
+	print <<END;
+    \\hline
+\\end{tabular}
+END
+}
+
+my $files_mode = (@ARGV && $ARGV[0] eq '--files') ? shift : undef;
 my $dir = shift;
-die "Usage: $0 in/path/\n" unless defined $dir && -d $dir; 
+die "Usage: $0 [--files] in/path/\n" unless defined $dir && -d $dir; 
 
 # Which benchmark files to use (input directory)
 my %files;
 opendir(DIR, $dir) or die $!;
 while (my $file = readdir(DIR)) {
 	next if $file =~ /^\./; # starts with .
-	next if $file =~ /\.(xz|7z|out|flip|gz)$/; # working files
+	next if $file =~ /\.(xz|7z|out|flip|gz|pim)$/; # working files
 	next if $file eq 'md5sums' || $file eq 'README'; # cruft
 	$files{$file}++;
 }
@@ -236,11 +289,15 @@ my @cmds = (
 	{ p => '7z', c => 'a', d => 'e', f => 1,
 		args => [ '-m0=lzma -mx=9', '-m0=ppmd -mx=9' ] },
 	{ p => 'pompom', c => '', d => '-d',
-		args => ['-o6 -m2048' ] },
+		args => ['-o6 -m2048', '-o6 -m2048 --engine mix', 
+			'--engine fast' ] },
 #	{ p => 'pompom', c => '', d => '-d',
 #		args => [ '-o3 -m8', '-o5 -m64', '-o6 -m256' ] },
 );
 
+# Only pompom with whole set
+@cmds = grep { $_->{p} eq 'pompom' } @cmds if defined $files_mode;
+
 # Find out full path to command
 foreach my $cmd (@cmds) {
 	my $p = $cmd->{p};
@@ -251,4 +308,8 @@ foreach my $cmd (@cmds) {
 }
 
 my @fails = sort keys %files;
+if (defined $files_mode) {
+	&run_files_tests($cmds[0]->{p}, $dir, \@fails, $cmds[0]->{args}->[0]);
+	exit 0;
+}
 &run_compress_tests(\@cmds, $dir, \@fails);
@@ -0,0 +1,400 @@
+/**
+ * Binary context mixing engine. Each byte is coded as 8 binary
+ * decisions, high bit first. Each order of context has a table of bit
+ * predictors, found by hash of the context key which the model
+ * builds for its order. Predictors of a nibble are in one bucket of
+ * 16 (32 bytes), so a byte costs two buckets per order. First entry
+ * of bucket checks the context, and a context is kept in any of
+ * MixWays neighbouring buckets, replacing the least used one.
+ * Predictions in the logistic domain are mixed by weights selected by
+ * the bits of the byte so far and the highest order whose predictor
+ * has been updated more than once, and the weights learn from the
+ * coding error. Mixed probability is refined by an adaptive
+ * probability map in order-1 context, interpolated between 33 points
+ * of the stretched probability, and averaged 1:3 with it.
+ *
+ * With long-match model, the bit of the predicted byte is an input
+ * while the byte so far agrees with it.
+ *
+ * Predictor is 12 bits of probability and a 4-bit count, which slows
+ * the rate of adaptation from 1/1.5 down to 1/(MixCountMax+1.5).
+ *
+ * @author jkataja
+ */
+
+#pragma once
+
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <stdexcept>
+
+#include "pompom.hpp"
+#include "pompomdefs.hpp"
+#include "match.hpp"
+
+namespace pompom {
+
+// Logistic functions in tables, built once. Squash is interpolated
+// from integers at steps of 1/2 (as in lpaq1), so tables are the same
+// in every build whatever the floating point options.
+struct logistic {
+	int16 stretch[ BitTotal ];
+	int16 squash[ BitTotal ];
+	logistic() {
+		// 4096 / (1 + exp(-x)) for x = -8, -7.5 .. 8
+		static const int Knots[33] = { 1, 2, 3, 6, 10, 16, 27, 45, 73,
+			120, 194, 310, 488, 747, 1101, 1546, 2047, 2549, 2994, 3348,
+			3607, 3785, 3901, 3975, 4022, 4050, 4068, 4079, 4085, 4089,
+			4092, 4093, 4094 };
+		for (int i = 0 ; i < (int)BitTotal ; ++i) {
+			const int k = (i >> 7);
+			const int w = (i & 127);
+			int v = ((Knots[k] * (128 - w) + Knots[k + 1] * w + 64) >> 7);
+			squash[i] = (v < 1 ? 1 : (v > 4095 ? 4095 : v));
+		}
+		// Inverse of squash, so stretch(squash(x)) is close to x
+		int pi = 0;
+		for (int x = -2047 ; x <= 2047 ; ++x) {
+			int v = squash[x + 2048];
+			for (int j = pi ; j <= v ; ++j)
+				stretch[j] = x;
+			pi = v + 1;
+		}
+		for (int j = pi ; j < (int)BitTotal ; ++j)
+			stretch[j] = 2047;
+	}
+	static const logistic& get() {
+		static const logistic curve;
+		return curve;
+	}
+};
+
+class bitmix {
+public:
+	// Probability of next bit being 1 out of BitTotal
+	inline const uint32 p();
+
+	// Learn coded bit
+	inline void update(const bool);
+
+	// Start byte in contexts of orders 0..order given by keys
+	inline void start(const uint64 *);
+
+	// Forget all statistics for a new stream
+	void clear();
+
+	// Orders up to order in memory of bytes; long-match model is owned
+	// by caller (0 is none)
+	bitmix(const int, const size_t, match *);
+
+	// Copy of state using long-match model of caller
+	bitmix(const bitmix *, match *);
+
+	~bitmix();
+private:
+	bitmix();
+	bitmix(const bitmix&);
+	const bitmix& operator=(const bitmix&);
+
+	// Buckets of each order of context for memory
+	void sizes(const size_t);
+
+	// Bucket of order for context key and high nibble (0 for none),
+	// cleared when taken for another context
+	inline uint16 * bucket(const int, const uint32);
+
+	// Squash of mixed input clamped to table
+	inline const int squash(const int) const;
+
+	// Refine mixed probability in order-1 context with map
+	inline const int refine(const int);
+
+	// Stretch and squash tables
+	const logistic& curve;
+
+	const int order;
+
+	// Inputs: orders 0..order, long match and bias
+	const int inputs;
+
+	// Predictor tables of orders, buckets of 16 predictors each
+	uint16 * tables[ OrderMax + 1 ];
+	uint64 buckets[ OrderMax + 1 ];
+
+	// Context keys of orders for current byte
+	uint64 keys[ OrderMax + 1 ];
+
+	// Buckets of orders for current nibble
+	uint16 * slot[ OrderMax + 1 ];
+
+	// Weight sets by bits of byte so far and highest updated order,
+	// 16.16 fixed point, and set of current bit
+	int32 * weights;
+	int32 * wset;
+
+	// Adaptive probability map by previous byte and bits of byte so
+	// far, 33 points of 16 bits each, and point of current bit to learn
+	uint16 * apm;
+	uint32 apmat;
+
+	// Inputs of current bit in logistic domain
+	int st[ OrderMax + 3 ];
+
+	// Mixed and refined probability of current bit, 12 bits
+	int pm;
+	int pr;
+
+	// Bits of byte so far with leading 1, and bits of nibble so far
+	uint32 c0;
+	uint32 nib;
+
+	// Previous byte
+	uint32 c1;
+
+	// Long-match model (0 is none)
+	match * mm;
+
+	// Weight of each input at start, 16.16 fixed point
+	static const int32 WeightInit = (1 << 14);
+
+	// Bound of weights, so long runs of one bit can not overflow them
+	static const int32 WeightMax = (1 << 22);
+
+	// Fresh predictor: probability 1/2 and count 0
+	static const uint16 PredictorInit = 0x8000;
+
+	// Entries of probability map
+	static const size_t ApmLen = ((Alpha + 1) * (Alpha + 1) * 33);
+};
+
+bitmix::bitmix(const int ord, const size_t mem, match * longmatch)
+	: curve(logistic::get()), order(ord), inputs(ord + 3), apmat(0),
+	  pm(BitTotal >> 1), pr(BitTotal >> 1), c0(1), nib(1), c1(0), 
+	  mm(longmatch)
+{
+	memset(tables, 0, sizeof(tables));
+	memset(keys, 0, sizeof(keys));
+	memset(st, 0, sizeof(st));
+	sizes(mem);
+	weights = (int32 *) malloc((Alpha + 1) * (order + 2) * inputs 
+			* sizeof(int32));
+	apm = (uint16 *) malloc(ApmLen * sizeof(uint16));
+	bool failed = (weights == 0 || apm == 0);
+	for (int k = 0 ; k <= order && !failed ; ++k) {
+		tables[k] = (uint16 *) malloc(buckets[k] * 16 * sizeof(uint16));
+		failed = (tables[k] == 0);
+	}
+	if (failed) {
+		for (int k = 0 ; k <= order ; ++k)
+			free(tables[k]);
+		free(weights);
+		free(apm);
+		throw std::bad_alloc();
+	}
+	wset = weights;
+	clear();
+}
+
+bitmix::bitmix(const bitmix * base, match * longmatch)
+	: curve(base->curve), order(base->order), inputs(base->inputs), 
+	  apmat(base->apmat), pm(base->pm), pr(base->pr), c0(base->c0), 
+	  nib(base->nib), c1(base->c1), mm(longmatch)
+{
+	memset(tables, 0, sizeof(tables));
+	memcpy(buckets, base->buckets, sizeof(buckets));
+	memcpy(keys, base->keys, sizeof(keys));
+	memcpy(st, base->st, sizeof(st));
+	const size_t weightlen = (Alpha + 1) * (order + 2) * inputs;
+	weights = (int32 *) malloc(weightlen * sizeof(int32));
+	apm = (uint16 *) malloc(ApmLen * sizeof(uint16));
+	bool failed = (weights == 0 || apm == 0);
+	for (int k = 0 ; k <= order && !failed ; ++k) {
+		tables[k] = (uint16 *) malloc(buckets[k] * 16 * sizeof(uint16));
+		failed = (tables[k] == 0);
+	}
+	if (failed) {
+		for (int k = 0 ; k <= order ; ++k)
+			free(tables[k]);
+		free(weights);
+		free(apm);
+		throw std::bad_alloc();
+	}
+	memcpy(weights, base->weights, weightlen * sizeof(int32));
+	wset = weights + (base->wset - base->weights);
+	memcpy(apm, base->apm, ApmLen * sizeof(uint16));
+	for (int k = 0 ; k <= order ; ++k) {
+		memcpy(tables[k], base->tables[k],
+				buckets[k] * 16 * sizeof(uint16));
+		slot[k] = tables[k] + (base->slot[k] - base->tables[k]);
+	}
+}
+
+bitmix::~bitmix() {
+	for (int k = 0 ; k <= order ; ++k)
+		free(tables[k]);
+	free(weights);
+	free(apm);
+}
+
+void bitmix::sizes(const size_t mem) {
+	// Orders 0 and 1 take at most all their contexts, 17 buckets
+	// each rounded to ways; rest of memory after probability map is
+	// split evenly
+	const size_t apmlen = ApmLen * sizeof(uint16);
+	size_t left = (mem > apmlen ? mem - apmlen : 0) / (16 * sizeof(uint16));
+	int even = order + 1;
+	for (int k = 0 ; k <= 1 && k <= order ; ++k) {
+		const uint64 all = (((17ULL << (k << 3)) + MixWays - 1) 
+				& ~(uint64)(MixWays - 1));
+		if (all < left / even) {
+			buckets[k] = all;
+			left -= all;
+			--even;
+		}
+		else
+			buckets[k] = 0;
+	}
+	for (int k = 0 ; k <= order ; ++k)
+		if (k > 1 || buckets[k] == 0)
+			buckets[k] = std::max((uint64)(left / even) 
+					& ~(uint64)(MixWays - 1), (uint64)MixWays);
+}
+
+void bitmix::clear() {
+	for (int k = 0 ; k <= order ; ++k) {
+		uint16 * t = tables[k];
+		for (uint64 i = 0 ; i < buckets[k] * 16 ; ++i)
+			t[i] = PredictorInit;
+	}
+	for (int i = 0 ; i < (Alpha + 1) * (order + 2) * inputs ; ++i)
+		weights[i] = WeightInit;
+	wset = weights;
+	for (size_t i = 0 ; i < ApmLen ; i += 33)
+		for (int j = 0 ; j < 33 ; ++j)
+			apm[i + j] = (uint16)(squash((j - 16) << 7) << 4);
+	apmat = 0;
+	memset(keys, 0, sizeof(keys));
+	pm = pr = (BitTotal >> 1);
+	for (int k = 0 ; k <= order ; ++k)
+		slot[k] = bucket(k, 0);
+	c0 = nib = 1;
+	c1 = 0;
+}
+
+uint16 * bitmix::bucket(const int k, const uint32 hi) {
+	const uint64 h = ((keys[k] + hi) * 0x9E3779B97F4A7C15ULL);
+	const uint64 i = (uint64)(((unsigned __int128)h * buckets[k]) >> 64);
+	const uint16 check = (uint16)(h >> 32);
+	uint16 * t = tables[k] + (i << 4);
+	if (t[0] == check)
+		return t;
+
+	// Other buckets of group, replacing bucket of fewest updates of
+	// first predictor
+	for (int j = 1 ; j < MixWays ; ++j) {
+		uint16 * b = tables[k] + ((i ^ j) << 4);
+		if (b[0] == check)
+			return b;
+		if ((b[1] & 15) < (t[1] & 15))
+			t = b;
+	}
+	t[0] = check;
+	for (int j = 1 ; j < 16 ; ++j)
+		t[j] = PredictorInit;
+	return t;
+}
+
+const int bitmix::squash(const int x) const {
+	if (x > 2047)
+		return 4095;
+	if (x < -2047)
+		return 1;
+	return curve.squash[x + 2048];
+}
+
+const int bitmix::refine(const int p) {
+	// Points on either side of stretched probability
+	const int s = ((curve.stretch[p] + 2048) << 5);
+	const int w = (s & 0xFFF);
+	const uint32 at = ((((c1 << 8) | c0) * 33) + (s >> 12));
+	apmat = at + (w >> 11);
+	const int a = ((apm[at] * (4096 - w) + apm[at + 1] * w) >> 16);
+	return std::max(1, std::min(4095, (p + 3 * a) >> 2));
+}
+
+const uint32 bitmix::p() {
+	for (int k = 0 ; k <= order ; ++k)
+		st[k] = curve.stretch[ slot[k][nib] >> 4 ];
+
+	// Expected bit of predicted byte while byte so far agrees
+	st[order + 1] = 0;
+	const int b = (mm ? mm->predicted() : -1);
+	if (b >= 0) {
+		const int bits = (31 - __builtin_clz(c0));
+		if ((uint32)((b | 0x100) >> (8 - bits)) == c0) {
+			const int s = curve.stretch[ mm->hitfreq() ];
+			st[order + 1] = (((b >> (7 - bits)) & 1) ? s : -s);
+		}
+	}
+	st[order + 2] = 256;
+
+	// Weight set by highest order updated more than once
+	int hi = 0;
+	for (int k = order ; k >= 0 && hi == 0 ; --k)
+		if ((slot[k][nib] & 15) > 1)
+			hi = k + 1;
+	wset = weights + (c0 + (Alpha + 1) * hi) * inputs;
+
+	int64 dot = 0;
+	for (int i = 0 ; i < inputs ; ++i)
+		dot += (int64)wset[i] * st[i];
+	pm = squash((int)(dot >> 16));
+	pr = refine(pm);
+	return pr;
+}
+
+void bitmix::update(const bool y) {
+	// Map point moves toward bit
+	const int g = (((int)y << 16) + ((int)y << MixApmRate) - y - y);
+	apm[apmat] += ((g - apm[apmat]) >> MixApmRate);
+
+	// Weights learn from error of mixed probability
+	const int err = (((int)y << 12) - pm) * MixRate;
+	for (int i = 0 ; i < inputs ; ++i)
+		wset[i] = std::max(-WeightMax, 
+				std::min(WeightMax, wset[i] + ((st[i] * err) >> 10)));
+
+	// Predictors move toward bit by rate of their count
+	static const int Recip[16] = { 43691, 26214, 18725, 14564, 11916,
+		10082, 8738, 7710, 6899, 6242, 5699, 5243, 4855, 4520, 4228, 3971 };
+	for (int k = 0 ; k <= order ; ++k) {
+		uint16& v = slot[k][nib];
+		const int n = (v & 15);
+		int q = (v >> 4);
+		q += (((((int)y << 12) - (int)y) - q) * Recip[n]) >> 16;
+		v = (uint16)((q << 4) | (n < MixCountMax ? n + 1 : n));
+	}
+
+	c0 = ((c0 << 1) | y);
+	nib = ((nib << 1) | y);
+	if (c0 >= 256)
+		c1 = (c0 & 0xFF);
+
+	// Buckets of low nibble follow high nibble
+	if (nib >= 16 && c0 < 256) {
+		for (int k = 0 ; k <= order ; ++k)
+			slot[k] = bucket(k, c0);
+		nib = 1;
+	}
+}
+
+void bitmix::start(const uint64 * context) {
+	for (int k = 0 ; k <= order ; ++k) {
+		keys[k] = context[k];
+		slot[k] = bucket(k, 0);
+	}
+	c0 = nib = 1;
+}
+
+} // namespace
@@ -0,0 +1,274 @@
+/**
+ * Block decoder of the fast engine. Frequency table of a context is
+ * spread to slots, one for each value of the low bits of a state,
+ * which give symbol, frequency and offset in a word,
+ * so decoding a symbol is one lookup, one multiply and at most one
+ * word read. FastLanes states decode their parts of the block in
+ * lockstep, each from its own word stream, without dependencies
+ * between them. Buffers grow with the blocks and tables read.
+ *
+ * @see blockencoder.hpp
+ * @author jkataja
+ */
+
+#pragma once
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <stdexcept>
+
+#include "pompom.hpp"
+#include "pompomdefs.hpp"
+#include "profile.hpp"
+
+namespace pompom {
+
+class blockdecoder {
+public:
+	// Decode next block, returns its length, 0 at end of stream or -1
+	// on unexpected end
+	const long next();
+
+	// Bytes of block decoded last
+	const char * data() const;
+
+	blockdecoder(std::istream&);
+	~blockdecoder();
+private:
+	blockdecoder();
+	blockdecoder(const blockdecoder&);
+	const blockdecoder& operator=(const blockdecoder&);
+
+	// Decode word streams of states to n bytes with slots of contexts
+	// (order-1 or not), returns false if code does not end in initial
+	// states
+	template <bool Order1>
+	const bool decode_lanes(const uint32, const uint32 *);
+
+	// Read table of frequencies of total 1 << bits to slots, returns
+	// false on unexpected end
+	const bool read_freq(uint32 *, const int);
+
+	// Read integer of n bytes
+	const uint64 read_int(const int);
+
+	// Grow buffer to at least n elements of size
+	static void grow(void **, uint32&, const uint32, const size_t);
+
+	std::istream& in;
+
+	// Decoded bytes of block
+	uint8 * buf;
+	uint32 bufcap;
+
+	// Word streams of states as bytes, each in a part of its own
+	uint8 * code;
+	uint32 codecap;
+
+	// Slots of order-0 or order-1 contexts: symbol in low 8 bits,
+	// offset from first slot of symbol in next 12 bits and frequency - 1
+	// in top 12
+	uint32 * slots;
+	uint32 slotcap;
+};
+
+blockdecoder::blockdecoder(std::istream& is)
+	: in(is), buf(0), bufcap(0), code(0), codecap(0), slots(0), slotcap(0)
+{
+}
+
+blockdecoder::~blockdecoder() {
+	free(buf);
+	free(code);
+	free(slots);
+}
+
+const char * blockdecoder::data() const {
+	return (const char *)buf;
+}
+
+void blockdecoder::grow(void ** p, uint32& cap, const uint32 need,
+		const size_t size)
+{
+	if (need <= cap)
+		return;
+	uint32 c = std::max(cap, (uint32)4096);
+	while (c < need)
+		c <<= 1;
+	void * q = realloc(*p, (size_t)c * size);
+	if (q == 0)
+		throw std::bad_alloc();
+	*p = q;
+	cap = c;
+}
+
+const uint64 blockdecoder::read_int(const int k) {
+	uint64 v = 0;
+	for (int i = 0 ; i < k ; ++i)
+		v = ((v << 8) | (in.get() & 0xFF));
+	return v;
+}
+
+const bool blockdecoder::read_freq(uint32 * slot, const int bits) {
+	uint8 bitmap[32];
+	if (!in.read((char *)bitmap, sizeof(bitmap)))
+		return false;
+	uint32 start = 0;
+	for (int s = 0 ; s < 256 ; ++s) {
+		if ((bitmap[ s >> 3 ] & (1 << (s & 7))) == 0)
+			continue;
+		const uint32 f = (uint32)read_int(2);
+		if (in.eof())
+			return false;
+		if (f == 0 || start + f > (1U << bits)) {
+			throw std::range_error("frequency table out of range");
+		}
+		for (uint32 k = 0 ; k < f ; ++k)
+			slot[start + k] = (s | (k << 8) | ((f - 1) << 20));
+		start += f;
+	}
+	if (start != (1U << bits)) {
+		throw std::range_error("frequency table out of range");
+	}
+	return true;
+}
+
+const long blockdecoder::next() {
+	const uint32 n = (uint32)read_int(4);
+	if (in.eof())
+		return -1;
+	if (n == 0)
+		return 0;
+	if (n > (uint32)FastBlock) {
+		throw std::range_error("block length out of range");
+	}
+
+	const int type = in.get();
+	grow((void **)&buf, bufcap, n, 1);
+	if (type == FastStored) {
+		profile::timer input(PhaseInput);
+		return (in.read((char *)buf, n) ? (long)n : -1);
+	}
+	if (type != FastOrder0 && type != FastOrder1) {
+		throw std::range_error("unknown block type");
+	}
+
+	// Tables of order-0 or present order-1 contexts
+	if (type == FastOrder0) {
+		grow((void **)&slots, slotcap, 1 << FastScaleBits, sizeof(uint32));
+		if (!read_freq(slots, FastScaleBits))
+			return -1;
+	}
+	else {
+		grow((void **)&slots, slotcap, 256 << FastScaleBits1,
+				sizeof(uint32));
+		uint8 bitmap[32];
+		if (!in.read((char *)bitmap, sizeof(bitmap)))
+			return -1;
+		for (int ctx = 0 ; ctx < 256 ; ++ctx) {
+			uint32 * slot = slots + (ctx << FastScaleBits1);
+			// Only corrupt code reaches a missing context; its slots are
+			// cleared instead of left from an earlier block
+			if ((bitmap[ ctx >> 3 ] & (1 << (ctx & 7))) == 0)
+				memset(slot, 0, sizeof(uint32) << FastScaleBits1);
+			else if (!read_freq(slot, FastScaleBits1))
+				return -1;
+		}
+	}
+
+	// Each state has a word for every symbol of its part and its state
+	const uint32 seg = ((n + FastLanes - 1) / FastLanes);
+	uint32 words[ FastLanes ];
+	for (int l = 0 ; l < FastLanes ; ++l) {
+		words[l] = (uint32)read_int(4);
+		if (words[l] < 2 || words[l] > seg + 2) {
+			throw std::range_error("block code length out of range");
+		}
+	}
+	if (in.eof())
+		return -1;
+	grow((void **)&code, codecap, ((seg + 3) << 1) * FastLanes, 1);
+	{
+		profile::timer input(PhaseInput);
+		for (int l = 0 ; l < FastLanes ; ++l)
+			if (!in.read((char *)code + l * ((seg + 3) << 1), words[l] << 1))
+				return -1;
+	}
+
+	profile::timer timer(PhaseCode);
+	const bool ok = (type == FastOrder1
+			? decode_lanes<true>(n, words) : decode_lanes<false>(n, words));
+	if (!ok) {
+		throw std::range_error("block code does not end in initial state");
+	}
+	return (long)n;
+}
+
+template <bool Order1>
+const bool blockdecoder::decode_lanes(const uint32 n,
+		const uint32 * words)
+{
+	const uint32 seg = ((n + FastLanes - 1) / FastLanes);
+	const int bits = (Order1 ? FastScaleBits1 : FastScaleBits);
+	const uint32 mask = ((1 << bits) - 1);
+
+	// Stream of a state has room for a word of every symbol and one
+	// more, so reads of corrupt code stay in it and show in the final
+	// states
+	// Each state is kept with its stream, output and context, which
+	// are not laid out for vectors across states
+	struct lane {
+		uint32 x;
+		uint32 ctx;
+		const uint8 * w;
+		uint8 * o;
+	} ln[ FastLanes ];
+	for (int l = 0 ; l < FastLanes ; ++l) {
+		const uint8 * w = code + l * ((seg + 3) << 1);
+		ln[l].x = (w[0] | (w[1] << 8) | (w[2] << 16)
+				| ((uint32)w[3] << 24));
+		ln[l].ctx = 0;
+		ln[l].w = w + 4;
+		ln[l].o = buf + l * seg;
+	}
+
+	// Next symbol of part l, context is kept from last symbol instead
+	// of read back from the block
+	const uint32 * const slot = slots;
+	auto step = [&](const int l) {
+		lane& a = ln[l];
+		const uint32 e = slot[ a.ctx + (a.x & mask) ];
+		*a.o++ = (uint8)e;
+		if (Order1)
+			a.ctx = ((e & 0xFF) << bits);
+		uint32 x = ((e >> 20) + 1) * (a.x >> bits) 
+			+ ((e >> 8) & 0xFFF);
+
+		// Renormalize without branch, which would be unpredictable
+		const uint32 more = (x < FastLow);
+		const uint32 word = (a.w[0] | (a.w[1] << 8));
+		a.x = ((x << (more << 4)) | (word & (0U - more)));
+		a.w += (more << 1);
+	};
+
+	// Rows of all parts, then rows of the parts which are longer
+	const uint32 tail = ((FastLanes - 1) * seg);
+	const uint32 full = (n > tail ? n - tail : 0);
+	uint32 j = 0;
+	for ( ; j < full ; ++j)
+		for (int l = 0 ; l < FastLanes ; ++l)
+			step(l);
+	for ( ; j < seg ; ++j)
+		for (int l = 0 ; l * seg + j < n ; ++l)
+			step(l);
+
+	bool ok = true;
+	for (int l = 0 ; l < FastLanes ; ++l)
+		ok = (ok && ln[l].x == FastLow
+				&& ln[l].w == code + l * ((seg + 3) << 1) + (words[l] << 1));
+	return ok;
+}
+
+} // namespace
@@ -0,0 +1,502 @@
+/**
+ * Block encoder of the fast engine. Input is cut into blocks of up to
+ * FastBlock bytes, and each block is coded with static frequencies of
+ * its own bytes in order-0 or order-1 context, whichever is estimated
+ * shorter with its tables, or stored when neither codes it smaller.
+ *
+ * Symbols are coded with rANS in FastLanes interleaved 32-bit states,
+ * renormalized by 16-bit words. Frequencies are scaled to 12 bits, or
+ * to 10 bits in order-1 contexts. Block is cut into FastLanes parts of
+ * equal length and each state codes one part to a word stream of its
+ * own, so the states, order-1 contexts and word reads of parts do not
+ * depend on each other. First byte of a part has order-1 context 0.
+ * Encoder runs backwards over the block, divides by a reciprocal of
+ * frequency and stores words from the end of the stream backwards, so
+ * the decoder reads them forwards.
+ *
+ * Buffers grow with the pending input, so short blocks of messages
+ * and frequent sync flush points cost only their own bytes. Block is
+ * stored without counting contexts when its order-0 table alone is not
+ * shorter, and otherwise only counts of its bytes in its contexts are
+ * estimated and cleared.
+ *
+ * Block is length in 4 bytes and block type in 1 byte, followed by
+ * stored bytes, or frequency tables, count of words of each state in
+ * 4 bytes and the words of each state. Table is a bitmap of 32 bytes
+ * of symbols and frequency of each symbol in 2 bytes; order-1 block
+ * has a bitmap of contexts and a table for each context. Block of
+ * length 0 is end of stream.
+ *
+ * @see Duda, J. (2013) Asymmetric numeral systems: entropy coding
+ *      combining speed of Huffman coding with compression rate of
+ *      arithmetic coding, arXiv:1311.2540
+ * @see https://github.com/rygorous/ryg_rans
+ * @author jkataja
+ */
+
+#pragma once
+
+#include <iostream>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+#include "pompom.hpp"
+#include "pompomdefs.hpp"
+#include "profile.hpp"
+
+namespace pompom {
+
+class blockencoder {
+public:
+	// Add a byte, block is coded when full
+	inline void put(const uint8);
+
+	// Add bytes, full blocks are coded without copying
+	void write(const char *, const size_t);
+
+	// Code pending bytes as a block of their own
+	void flush();
+
+	// Code pending bytes and end of stream
+	void finish();
+
+	// Length of output bytes
+	const uint64 len() const;
+
+	blockencoder(std::ostream&);
+	~blockencoder();
+private:
+	blockencoder();
+	blockencoder(const blockencoder&);
+	const blockencoder& operator=(const blockencoder&);
+
+	// Symbol of encoder: bound of state before coding, and division by
+	// frequency as multiply by reciprocal and shift
+	struct symbol {
+		uint32 xmax;
+		uint32 rcp;
+		uint32 bias;
+		uint16 cmpl;
+		uint16 shift;
+	};
+
+	// Code bytes as a block
+	void code_block(const uint8 *, const uint32);
+
+	// Code bytes with symbols of contexts (order-1 or not) to word
+	// streams of states, returns count of words of each state
+	void code_lanes(const uint8 *, const uint32, const symbol *,
+			const bool, uint32 *);
+
+	// Scale counts to frequencies of total 1 << bits, each counted
+	// symbol at least 1; returns count of symbols
+	static const int normalize(const uint32 *, uint16 *, const int);
+
+	// Estimated bits of code and table for counts of symbols
+	static const double cost(const uint32 *, const uint8 *, const int);
+
+	// Encoder symbols for frequencies of total 1 << bits
+	static void prepare(const uint16 *, symbol *, const int);
+
+	// Write table of frequencies
+	void write_freq(const uint16 *);
+
+	// Write integer of n bytes
+	void write_int(const uint64, const int);
+
+	// Grow buffer to at least n elements of size, doubling
+	static void grow(void **, uint32&, const uint32, const size_t);
+
+	std::ostream& out;
+
+	// Pending bytes of block
+	uint8 * buf;
+	uint32 n;
+	uint32 bufcap;
+
+	// Counts of order-1 contexts, cleared for contexts of each block
+	uint32 * count;
+
+	// Frequencies and symbols of encoder of order-0, and of order-1
+	// contexts allocated for first order-1 block
+	uint16 freq0[256];
+	symbol syms0[256];
+	uint16 * freq1;
+	symbol * syms1;
+
+	// Word streams of states as bytes, each from end of its part
+	uint8 * code;
+	uint32 codecap;
+
+	uint64 outlen;
+};
+
+blockencoder::blockencoder(std::ostream& os)
+	: out(os), buf(0), n(0), bufcap(0), count(0), freq1(0), syms1(0),
+	  code(0), codecap(0), outlen(0)
+{
+}
+
+blockencoder::~blockencoder() {
+	free(buf);
+	free(count);
+	free(freq1);
+	free(syms1);
+	free(code);
+}
+
+void blockencoder::grow(void ** p, uint32& cap, const uint32 need,
+		const size_t size)
+{
+	if (need <= cap)
+		return;
+	uint32 c = std::max(cap, (uint32)4096);
+	while (c < need)
+		c <<= 1;
+	void * q = realloc(*p, (size_t)c * size);
+	if (q == 0)
+		throw std::bad_alloc();
+	*p = q;
+	cap = c;
+}
+
+void blockencoder::put(const uint8 c) {
+	if (n == bufcap)
+		grow((void **)&buf, bufcap, n + 1, 1);
+	buf[n++] = c;
+	if (n == (uint32)FastBlock) {
+		code_block(buf, n);
+		n = 0;
+	}
+}
+
+void blockencoder::write(const char * p, const size_t len) {
+	const uint8 * b = (const uint8 *)p;
+	size_t left = len;
+	while (left > 0) {
+		// Full blocks are coded from input
+		if (n == 0 && left >= (size_t)FastBlock) {
+			code_block(b, FastBlock);
+			b += FastBlock;
+			left -= FastBlock;
+			continue;
+		}
+		const uint32 k = (uint32)std::min(left, (size_t)(FastBlock - n));
+		grow((void **)&buf, bufcap, n + k, 1);
+		memcpy(buf + n, b, k);
+		n += k;
+		b += k;
+		left -= k;
+		if (n == (uint32)FastBlock) {
+			code_block(buf, n);
+			n = 0;
+		}
+	}
+}
+
+void blockencoder::flush() {
+	if (n > 0)
+		code_block(buf, n);
+	n = 0;
+	out.flush();
+}
+
+void blockencoder::finish() {
+	if (n > 0)
+		code_block(buf, n);
+	n = 0;
+	write_int(0, 4);
+}
+
+const uint64 blockencoder::len() const {
+	return outlen;
+}
+
+void blockencoder::write_int(const uint64 v, const int k) {
+	char b[8];
+	for (int i = 0 ; i < k ; ++i)
+		b[i] = (char)((v >> ((k - 1 - i) << 3)) & 0xFF);
+	out.write(b, k);
+	outlen += k;
+}
+
+const int blockencoder::normalize(const uint32 * cnt, uint16 * f,
+		const int bits)
+{
+	uint64 total = 0;
+	int top = -1;
+	int syms = 0;
+	for (int s = 0 ; s < 256 ; ++s) {
+		total += cnt[s];
+		if (cnt[s] > 0) {
+			++syms;
+			if (top < 0 || cnt[s] > cnt[top])
+				top = s;
+		}
+	}
+	if (syms == 0) {
+		memset(f, 0, 256 * sizeof(uint16));
+		return 0;
+	}
+
+	const int scale = (1 << bits);
+	int sum = 0;
+	for (int s = 0 ; s < 256 ; ++s) {
+		f[s] = 0;
+		if (cnt[s] > 0) {
+			f[s] = std::max((uint64)1, ((uint64)cnt[s] * scale) / total);
+			sum += f[s];
+		}
+	}
+
+	// Rounding is taken by the most frequent symbol, or by each symbol
+	// in turn when it would vanish
+	int left = (scale - sum);
+	if ((int)f[top] + left >= 1) {
+		f[top] += left;
+		return syms;
+	}
+	while (left < 0)
+		for (int s = 0 ; s < 256 && left < 0 ; ++s)
+			if (f[s] > 1) {
+				--f[s];
+				++left;
+			}
+	return syms;
+}
+
+const double blockencoder::cost(const uint32 * cnt, const uint8 * sym,
+		const int nsym)
+{
+	uint64 total = 0;
+	int syms = 0;
+	for (int i = 0 ; i < nsym ; ++i) {
+		total += cnt[ sym[i] ];
+		syms += (cnt[ sym[i] ] > 0);
+	}
+	if (total == 0)
+		return 0;
+	double bits = 0;
+	for (int i = 0 ; i < nsym ; ++i)
+		if (cnt[ sym[i] ] > 0)
+			bits += cnt[ sym[i] ] * log2((double)total / cnt[ sym[i] ]);
+	return bits + (32 + 2 * syms) * 8;
+}
+
+void blockencoder::prepare(const uint16 * f, symbol * sym,
+		const int bits)
+{
+	uint32 start = 0;
+	for (int s = 0 ; s < 256 ; ++s) {
+		if (f[s] == 0)
+			continue;
+		symbol& e = sym[s];
+		e.xmax = ((FastLow >> bits) << 16) * f[s];
+		e.cmpl = (uint16)((1 << bits) - f[s]);
+		if (f[s] < 2) {
+			e.rcp = ~0U;
+			e.shift = 0;
+			e.bias = start + (1 << bits) - 1;
+		}
+		else {
+			uint32 shift = 0;
+			while (f[s] > (1U << shift))
+				++shift;
+			e.rcp = (uint32)(((1ULL << (shift + 31)) + f[s] - 1) / f[s]);
+			e.shift = (uint16)(shift - 1);
+			e.bias = start;
+		}
+		start += f[s];
+	}
+}
+
+void blockencoder::write_freq(const uint16 * f) {
+	uint8 bitmap[32] = { 0 };
+	for (int s = 0 ; s < 256 ; ++s)
+		if (f[s] > 0)
+			bitmap[ s >> 3 ] |= (1 << (s & 7));
+	out.write((const char *)bitmap, sizeof(bitmap));
+	outlen += sizeof(bitmap);
+	for (int s = 0 ; s < 256 ; ++s)
+		if (f[s] > 0)
+			write_int(f[s], 2);
+}
+
+void blockencoder::code_block(const uint8 * b, const uint32 len) {
+	profile::timer timer(PhaseCode);
+
+	uint32 order0[256] = { 0 };
+	for (uint32 i = 0 ; i < len ; ++i)
+		++order0[ b[i] ];
+
+	// Symbols are the bytes of block, contexts also have context 0
+	uint8 syms[256];
+	uint8 ctxs[256];
+	int nsym = 0;
+	int nctx = 0;
+	for (int c = 0 ; c < 256 ; ++c) {
+		if (order0[c] > 0)
+			syms[nsym++] = (uint8)c;
+		if (c == 0 || order0[c] > 0)
+			ctxs[nctx++] = (uint8)c;
+	}
+
+	// Stored without counting contexts when order-0 table and counts of
+	// words and states alone are not shorter than block
+	int type = FastStored;
+	const uint32 seg = ((len + FastLanes - 1) / FastLanes);
+	const bool counted = ((32 + 2 * nsym + 8 * FastLanes) < (int)len);
+	if (counted) {
+		if (count == 0) {
+			count = (uint32 *) calloc(256 * 256, sizeof(uint32));
+			if (count == 0)
+				throw std::bad_alloc();
+		}
+
+		// Counts in order-1 context, first byte of each part in context 0
+		for (uint32 p = 0 ; p < len ; p += seg) {
+			const uint32 end = std::min(len, p + seg);
+			++count[ b[p] ];
+			for (uint32 i = p + 1 ; i < end ; ++i)
+				++count[ (b[i - 1] << 8) + b[i] ];
+		}
+
+		double bits1 = 32 * 8;
+		for (int k = 0 ; k < nctx ; ++k)
+			bits1 += cost(count + (ctxs[k] << 8), syms, nsym);
+		const double bits0 = cost(order0, syms, nsym);
+
+		// Stored when coding gains less than counts of words and states
+		type = (bits1 < bits0 ? FastOrder1 : FastOrder0);
+		if (std::min(bits0, bits1) + (8 * FastLanes) * 8 >= len * 8.0)
+			type = FastStored;
+	}
+
+	write_int(len, 4);
+	out << (char)type;
+	++outlen;
+	if (type == FastStored) {
+		out.write((const char *)b, len);
+		outlen += len;
+	}
+	else if (type == FastOrder0) {
+		normalize(order0, freq0, FastScaleBits);
+		prepare(freq0, syms0, FastScaleBits);
+		write_freq(freq0);
+	}
+	else {
+		if (freq1 == 0) {
+			freq1 = (uint16 *) malloc(256 * 256 * sizeof(uint16));
+			syms1 = (symbol *) malloc(256 * 256 * sizeof(symbol));
+			if (freq1 == 0 || syms1 == 0)
+				throw std::bad_alloc();
+		}
+		uint8 bitmap[32] = { 0 };
+		for (int k = 0 ; k < nctx ; ++k) {
+			const int ctx = ctxs[k];
+			if (normalize(count + (ctx << 8), freq1 + (ctx << 8),
+						FastScaleBits1) > 0) {
+				prepare(freq1 + (ctx << 8), syms1 + (ctx << 8),
+						FastScaleBits1);
+				bitmap[ ctx >> 3 ] |= (1 << (ctx & 7));
+			}
+		}
+		out.write((const char *)bitmap, sizeof(bitmap));
+		outlen += sizeof(bitmap);
+		for (int k = 0 ; k < nctx ; ++k)
+			if (bitmap[ ctxs[k] >> 3 ] & (1 << (ctxs[k] & 7)))
+				write_freq(freq1 + (ctxs[k] << 8));
+	}
+
+	// Counts of symbols in contexts of block are cleared for next block
+	if (counted)
+		for (int k = 0 ; k < nctx ; ++k)
+			for (int i = 0 ; i < nsym ; ++i)
+				count[ (ctxs[k] << 8) + syms[i] ] = 0;
+	if (type == FastStored)
+		return;
+
+	// Each state has room for a word of every symbol and its state
+	const uint32 room = ((seg + 2) << 1);
+	grow((void **)&code, codecap, room * FastLanes, 1);
+	uint32 words[ FastLanes ];
+	if (type == FastOrder1)
+		code_lanes(b, len, syms1, true, words);
+	else
+		code_lanes(b, len, syms0, false, words);
+	for (int l = 0 ; l < FastLanes ; ++l)
+		write_int(words[l], 4);
+	for (int l = 0 ; l < FastLanes ; ++l) {
+		out.write((const char *)code + (l + 1) * room - (words[l] << 1),
+				words[l] << 1);
+		outlen += (words[l] << 1);
+	}
+}
+
+void blockencoder::code_lanes(const uint8 * b, const uint32 len,
+		const symbol * syms, const bool order1, uint32 * words)
+{
+	const uint32 seg = ((len + FastLanes - 1) / FastLanes);
+	const uint32 room = ((seg + 2) << 1);
+
+	// Each state is kept with its stream, which are not laid out for
+	// vectors across states
+	struct lane {
+		uint32 x;
+		uint8 * w;
+	} ln[ FastLanes ];
+	for (int l = 0 ; l < FastLanes ; ++l) {
+		ln[l].x = FastLow;
+		ln[l].w = code + (l + 1) * room;
+	}
+
+	// Symbol at row j of part l in context; word is stored little-endian
+	// below the stream and kept when state is renormalized, without
+	// branch which would be unpredictable
+	auto step = [&](const int l, const uint32 j, const uint32 ctx) {
+		lane& a = ln[l];
+		const symbol& e = syms[ ctx + b[l * seg + j] ];
+		uint32 s = a.x;
+		const uint32 more = (s >= e.xmax);
+		a.w[-2] = (uint8)(s & 0xFF);
+		a.w[-1] = (uint8)((s >> 8) & 0xFF);
+		a.w -= (more << 1);
+		s >>= (more << 4);
+		const uint32 q = (uint32)(((uint64)s * e.rcp) >> 32) >> e.shift;
+		a.x = s + e.bias + q * e.cmpl;
+	};
+
+	// Backwards over rows of parts which are longer, then rows of all
+	// parts, reverse of decoding order; first row is in context 0
+	const uint32 tail = ((FastLanes - 1) * seg);
+	const uint32 full = std::max(len > tail ? len - tail : 0, (uint32)1);
+	uint32 j = seg - 1;
+	for ( ; j >= full ; --j)
+		for (int l = 0 ; l * seg + j < len ; ++l)
+			step(l, j, (order1 ? b[l * seg + j - 1] << 8 : 0));
+	if (order1)
+		for ( ; j > 0 ; --j)
+			for (int l = 0 ; l < FastLanes ; ++l)
+				step(l, j, b[l * seg + j - 1] << 8);
+	else
+		for ( ; j > 0 ; --j)
+			for (int l = 0 ; l < FastLanes ; ++l)
+				step(l, j, 0);
+	for (int l = 0 ; l * seg < len ; ++l)
+		step(l, 0, 0);
+
+	// States are read first by decoder, low word first
+	for (int l = 0 ; l < FastLanes ; ++l) {
+		uint8 * w = (ln[l].w -= 4);
+		w[0] = (uint8)(ln[l].x & 0xFF);
+		w[1] = (uint8)((ln[l].x >> 8) & 0xFF);
+		w[2] = (uint8)((ln[l].x >> 16) & 0xFF);
+		w[3] = (uint8)(ln[l].x >> 24);
+		words[l] = (uint32)((code + (l + 1) * room - w) >> 1);
+	}
+}
+
+} // namespace
@@ -0,0 +1,134 @@
+/**
+ * Stream checksum over blocks of bytes. CRC32C is computed with SSE4.2
+ * crc32 instruction on 8 byte words when BUILTIN_CRC is set, otherwise
+ * with slicing-by-8 tables. CRC32 (boost::crc_32_type) is used for
+ * frames from earlier versions.
+ *
+ * @see http://www.intel.com/technology/comms/perfnet/download/CRC_generators.pdf
+ * @author jkataja
+ */
+
+#pragma once
+
+#include <stdexcept>
+#include <cstring>
+#include <boost/crc.hpp>
+
+#include "pompom.hpp"
+#include "pompomdefs.hpp"
+
+namespace pompom {
+
+class checksum {
+public:
+	// Add block of bytes to checksum
+	inline void update(const char *, const size_t);
+
+	// Checksum of bytes so far
+	const uint32 value() const;
+
+	// Checksum algorithm
+	const uint8 type;
+
+	checksum(const uint8);
+	~checksum();
+private:
+	checksum();
+	checksum(const checksum&);
+	const checksum& operator=(const checksum&);
+
+	// CRC32C of block
+	inline void update_crc32c(const uint8 *, size_t);
+
+	// CRC32 for frames from earlier versions
+	boost::crc_32_type crc32;
+
+	// CRC32C register
+	uint32 crc32c;
+
+	// CRC32C (Castagnoli) polynomial in reversed bit order
+	static const uint32 Poly = 0x82F63B78U;
+
+	// CRC32 checksum initial value
+	static const uint32 CRCInit = 0xFFFFFFFFU;
+
+	// Tables for slicing-by-8
+	static const uint32 (* tables())[256];
+};
+
+checksum::checksum(const uint8 t)
+	: type(t), crc32c(CRCInit)
+{
+	if (type != CheckCRC32 && type != CheckCRC32C) {
+		throw std::range_error("unknown checksum type");
+	}
+#ifndef BUILTIN_CRC
+	tables();
+#endif
+}
+
+checksum::~checksum() {
+}
+
+const uint32 (* checksum::tables())[256] {
+	// Initialized once on first use
+	static struct slicing {
+		uint32 t[8][256];
+		slicing() {
+			for (uint32 i = 0 ; i < 256 ; ++i) {
+				uint32 c = i;
+				for (int k = 0 ; k < 8 ; ++k)
+					c = (c & 1) ? ((c >> 1) ^ Poly) : (c >> 1);
+				t[0][i] = c;
+			}
+			for (uint32 i = 0 ; i < 256 ; ++i)
+				for (int k = 1 ; k < 8 ; ++k)
+					t[k][i] = (t[k - 1][i] >> 8) ^ t[0][ t[k - 1][i] & 0xFF ];
+		}
+	} s;
+	return s.t;
+}
+
+void checksum::update(const char * buf, const size_t n) {
+	if (type == CheckCRC32C)
+		update_crc32c((const uint8 *) buf, n);
+	else
+		crc32.process_bytes(buf, n);
+}
+
+void checksum::update_crc32c(const uint8 * p, size_t n) {
+	uint32 crc = crc32c;
+#ifdef BUILTIN_CRC
+	uint64 crc64 = crc;
+	for ( ; n >= 8 ; n -= 8, p += 8) {
+		uint64 w;
+		memcpy(&w, p, sizeof(w));
+		crc64 = __builtin_ia32_crc32di(crc64, w);
+	}
+	crc = crc64;
+	for ( ; n > 0 ; --n, ++p)
+		crc = __builtin_ia32_crc32qi(crc, *p);
+#else
+	const uint32 (* t)[256] = tables();
+	// Words are assembled from bytes, independent of host byte order
+	for ( ; n >= 8 ; n -= 8, p += 8) {
+		uint32 lo = crc ^ (p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32)p[3] << 24));
+		uint32 hi = (p[4] | (p[5] << 8) | (p[6] << 16) | ((uint32)p[7] << 24));
+		crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF]
+			^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24]
+			^ t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF]
+			^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+	}
+	for ( ; n > 0 ; --n, ++p)
+		crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xFF];
+#endif
+	crc32c = crc;
+}
+
+const uint32 checksum::value() const {
+	if (type == CheckCRC32C)
+		return (crc32c ^ CRCInit);
+	return crc32.checksum();
+}
+
+} // namespace
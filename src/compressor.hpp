@@ -0,0 +1,419 @@
+/**
+ * Streaming compressor. Codes input bytes with the model and encoder
+ * one at a time. Sync flush writes out the coder state on a byte
+ * boundary while the model keeps its statistics, so a decoder can
+ * decode all input given so far from the output written so far.
+ *
+ * Sync flush point is coded as escape in -1th order context, which
+ * has frequency only when model is created with sync flush points.
+ *
+ * With long-match model, hit or miss of the predicted byte is coded
+ * first. Miss excludes the predicted byte from the contexts.
+ *
+ * With deduplication, input goes through the dedup stage and each
+ * output of it is coded first as a bit for reference or literal. 
+ * Reference is coded as distance and length, and its bytes are not
+ * seen by the model.
+ *
+ * With the mixing engine, each byte is coded as 8 bits predicted by
+ * the mixer, after a bit for end of stream or sync flush point which
+ * has the least frequency.
+ *
+ * With the fast engine, bytes go to the block encoder without the model
+ * or arithmetic coder, and sync flush point ends the current block.
+ *
+ * @author jkataja
+ */
+
+#pragma once
+
+#include <iostream>
+#include <stdexcept>
+#include <cstring>
+#include <boost/format.hpp>
+
+#include "pompom.hpp"
+#include "model.hpp"
+#include "encoder.hpp"
+#include "blockencoder.hpp"
+#include "checksum.hpp"
+#include "dedup.hpp"
+#include "profile.hpp"
+
+namespace pompom {
+
+class compressor {
+public:
+	// Compress a byte
+	inline void put(const uint8);
+
+	// Compress bytes, the fast engine codes them as a block without
+	// going through put
+	void write(const char *, const size_t);
+
+	// Sync flush point
+	void sync();
+
+	// Output EOS and pending output
+	void finish();
+
+	// Count of bytes compressed
+	const uint64 len() const;
+
+	// Count of code bytes written
+	const uint64 outlen() const;
+
+	// Count of sync flush points
+	const uint64 syncs() const;
+
+	// Checksum of bytes compressed, after finish
+	const uint32 checksum() const;
+
+	compressor(std::ostream&, model *, const uint8, dedup * = 0);
+	~compressor();
+private:
+	compressor();
+	compressor(const compressor&);
+	const compressor& operator=(const compressor&);
+
+	// Code a literal byte with the model
+	inline void code(const uint8);
+
+	// Code a literal byte as bits with the mixing engine
+	inline void code_bits(const uint8);
+
+	// Code end of stream or sync flush point with the mixing engine
+	inline void code_end(const bool);
+
+	// Code output of dedup stage
+	inline void drain();
+
+	// Code bit for reference or literal, when deduplicating
+	inline void code_ref(const bool);
+
+	// Escape from highest order to -1th order
+	inline void escape_all();
+
+	// Code hit or miss of byte (-1 for none) predicted by long match,
+	// returns true on hit
+	inline const bool code_match(const int);
+
+	// Model is owned by caller
+	model * m;
+
+	// Dedup stage is owned by caller (0 is none)
+	dedup * dd;
+
+	encoder enc;
+
+	// Block encoder of fast engine (0 is none)
+	blockencoder * blocks;
+
+	// Checksum is computed over blocks of input
+	pompom::checksum sum;
+	char block[ BlockSize ];
+	uint32 blockp;
+
+	uint32 dist[ R(EOS) + 1 ];
+
+	// Exclusion mask for chars which appeared in a higher order
+	uint64 x_mask[4];
+
+	uint64 inlen;
+	uint64 synclen;
+
+	// Bytes compressed since last sync flush point
+	bool pending;
+};
+
+compressor::compressor(std::ostream& out, model * proxy, const uint8 check,
+		dedup * stage)
+	: m(proxy), dd(stage), enc(out), blocks(0), sum(check), blockp(0), 
+	  inlen(0), synclen(0), pending(false)
+{
+	memset(dist, 0, sizeof(dist));
+	if (m->engine == EngineFast)
+		blocks = new blockencoder(out);
+}
+
+compressor::~compressor() {
+	delete blocks;
+}
+
+void compressor::put(const uint8 c) {
+	if (dd) {
+		dd->push(c);
+		drain();
+	}
+	else
+		code(c);
+
+	// Checksum of full block
+	block[blockp++] = c;
+	if (blockp == BlockSize) {
+		profile::timer check(PhaseChecksum);
+		sum.update(block, blockp);
+		blockp = 0;
+	}
+
+	++inlen;
+	pending = true;
+}
+
+void compressor::write(const char * p, const size_t n) {
+	if (!blocks || dd) {
+		for (size_t i = 0 ; i < n ; ++i)
+			put(p[i]);
+		return;
+	}
+
+	// Checksum of partial block and then of bytes as they are
+	{
+		profile::timer check(PhaseChecksum);
+		sum.update(block, blockp);
+		blockp = 0;
+		sum.update(p, n);
+	}
+	blocks->write(p, n);
+
+	inlen += n;
+	if (n > 0)
+		pending = true;
+}
+
+void compressor::code(const uint8 c) {
+	if (blocks) {
+		blocks->put(c);
+		return;
+	}
+	if (m->mixer()) {
+		code_bits(c);
+		return;
+	}
+
+	// Phases of sampled byte are timed when profiling
+	profile * prof = profile::active;
+	const bool timed = (prof && prof->sample(PhaseDist));
+	uint64 t = (timed ? prof->clock() : 0);
+
+	code_ref(false);
+	memset(x_mask, 0xFF, sizeof(long) * 4);
+	// Byte predicted by long match is coded without contexts
+	const bool hit = code_match(c);
+	if (timed && m->matcher()) {
+		prof->add_sampled(PhaseCode, prof->clock() - t);
+		t = prof->clock();
+	}
+	if (!hit) {
+		// Seek character range
+		for (int ord = m->start() ; ord >= -1 ; --ord) {
+			m->dist(ord, dist, x_mask);
+			if (timed)
+				prof->add_sampled(PhaseDist, prof->clock() - t);
+			// Symbol c has frequency in context
+			if (dist[ L(c) ] != dist[ R(c) ]) {
+				STAT( m->coded(ord); )
+				break;
+			}
+			// Output escape when symbol c has zero frequency
+			if (timed)
+				t = prof->clock();
+			enc.encode(Escape, dist);
+			STAT( m->escaped(ord); )
+			if (timed) {
+				prof->add_sampled(PhaseCode, prof->clock() - t);
+				t = prof->clock();
+			}
+		}
+
+		// Output
+#ifndef UNSAFE
+		if (dist[ L(c) ] == dist[ R(c) ]) {
+			throw std::range_error(
+				boost::str ( boost::format("zero frequency for symbol %1%") % (int)c )
+			);
+		}
+#endif
+		if (timed)
+			t = prof->clock();
+		enc.encode(c, dist);
+		if (timed) {
+			prof->add_sampled(PhaseCode, prof->clock() - t);
+			t = prof->clock();
+		}
+	}
+
+	// Update model
+	m->update(c);
+	if (timed)
+		prof->add_sampled(PhaseUpdate, prof->clock() - t);
+}
+
+void compressor::code_bits(const uint8 c) {
+	// Phases of sampled byte are timed when profiling
+	profile * prof = profile::active;
+	const bool timed = (prof && prof->sample(PhaseDist));
+	uint64 t = (timed ? prof->clock() : 0);
+
+	code_ref(false);
+	enc.encode_bit(false, 1);
+	bitmix * bm = m->mixer();
+	for (int i = 7 ; i >= 0 ; --i) {
+		const bool bit = ((c >> i) & 1);
+		enc.encode_bit(bit, bm->p());
+		bm->update(bit);
+	}
+	if (timed) {
+		prof->add_sampled(PhaseCode, prof->clock() - t);
+		t = prof->clock();
+	}
+
+	// Update contexts of next byte
+	m->update(c);
+	if (timed)
+		prof->add_sampled(PhaseUpdate, prof->clock() - t);
+}
+
+void compressor::code_end(const bool eos) {
+	code_ref(false);
+	enc.encode_bit(true, 1);
+	// Sync flush point or EOS, when sync flush points are used
+	if (m->sync)
+		enc.encode_bit(eos, BitTotal >> 1);
+}
+
+void compressor::drain() {
+	uint64 dist;
+	uint64 n;
+	int v;
+	while ((v = dd->next(dist, n)) != dedup::None) {
+		if (v == dedup::Reference) {
+			code_ref(true);
+			enc.encode_int(dist);
+			enc.encode_int(n);
+		}
+		else
+			code(v);
+	}
+}
+
+void compressor::code_ref(const bool ref) {
+	if (dd == 0)
+		return;
+	enc.encode_bit(ref, dd->reffreq());
+	dd->coded(ref);
+}
+
+void compressor::escape_all() {
+	// Escape to -1 level
+	code_ref(false);
+	memset(x_mask, 0xFF, sizeof(long) * 4);
+	code_match(-1);
+	for (int ord = m->start() ; ord >= 0 ; --ord) {
+		m->dist(ord, dist, x_mask);
+		enc.encode(Escape, dist);
+	}
+	m->dist(-1, dist, x_mask);
+}
+
+const bool compressor::code_match(const int c) {
+	match * mm = m->matcher();
+	if (mm == 0)
+		return false;
+	const int p = mm->predicted();
+	if (p < 0)
+		return false;
+	const bool hit = (c == p);
+	enc.encode_bit(hit, mm->hitfreq());
+	STAT( m->matched(hit); )
+	if (!hit)
+		x_mask[ p >> 6 ] ^= ((1ULL << 63) >> (p & 63));
+	return hit;
+}
+
+void compressor::sync() {
+	if (!m->sync) {
+		throw std::logic_error("model has no sync flush points");
+	}
+
+	// Nothing to flush
+	if (!pending)
+		return;
+
+	// Lookahead of dedup stage
+	if (dd) {
+		dd->flush();
+		drain();
+	}
+
+	// Pending block is written out
+	if (blocks)
+		blocks->flush();
+	// Output escape in -1th order
+	else if (m->mixer())
+		code_end(false);
+	else {
+		escape_all();
+		enc.encode(Escape, dist);
+	}
+	m->discard();
+
+	// Write pending output
+	if (!blocks)
+		enc.sync();
+	++synclen;
+	pending = false;
+}
+
+void compressor::finish() {
+	// Lookahead of dedup stage
+	if (dd) {
+		dd->flush();
+		drain();
+	}
+
+	// Block of length 0 is EOS
+	if (blocks)
+		blocks->finish();
+	// Output EOS in -1th order
+	else if (m->mixer())
+		code_end(true);
+	else {
+		escape_all();
+#ifndef UNSAFE
+		if (dist[ L(EOS) ] == dist[ R(EOS) ]) {
+			throw std::range_error("zero frequency for EOS");
+		}
+#endif
+		enc.encode(EOS, dist);
+	}
+	m->discard();
+
+	// Write pending output
+	if (!blocks)
+		enc.finish();
+	pending = false;
+
+	// Checksum of last block
+	profile::timer check(PhaseChecksum);
+	sum.update(block, blockp);
+	blockp = 0;
+}
+
+const uint64 compressor::len() const {
+	return inlen;
+}
+
+const uint64 compressor::outlen() const {
+	return (blocks ? blocks->len() : enc.len());
+}
+
+const uint64 compressor::syncs() const {
+	return synclen;
+}
+
+const uint32 compressor::checksum() const {
+	return sum.value();
+}
+
+} // namespace
@@ -1,7 +1,20 @@
 /**
  * Cuckoo hash for storing Context -> { Frequency, Followers } mapping.
- * Hash table length is constant and whenever table becomes full,
- * any insertions will fail and the contents should be reset.
+ * Growing table starts from GrowStart MiB and doubles its length with
+ * a rehash when it fills, up to the memory limit. Table at its full
+ * length stays constant and whenever it becomes full, any insertions
+ * will fail and the contents should be reset.
+ *
+ * Fingerprint table keeps a 16-bit fingerprint of the context in place
+ * of the 64-bit key. Other slot of fingerprint is found from the slot
+ * and the fingerprint alone (partial-key cuckoo hashing), so table of
+ * fingerprints is fixed at the memory limit. Two contexts of the same
+ * fingerprint in one slot are taken for the same, which is the same in
+ * compressor and decompressor.
+ *
+ * Overlay table reads a read-only base table and records only the
+ * slots it changes, so that many overlays can share one warm table.
+ * Overlay copies the base when it is rescaled and drops it when reset.
  *
  * @see http://www.it-c.dk/people/pagh/papers/cuckoo-jour.pdf
  * @author jkataja
@@ -10,10 +23,15 @@
 #pragma once
 
 #include <iostream>
+#include <iomanip>
 #include <stdexcept>
+#include <cstring>
+#include <algorithm>
 
 #include "pompom.hpp"
 #include "pompomdefs.hpp"
+#include "overlay.hpp"
+#include "profile.hpp"
 
 namespace pompom {
 
@@ -31,6 +49,9 @@ public:
 	// Reset array contents
 	void reset();
 
+	// Reset to starting length for a new stream
+	void clear();
+
 	// Rescale all value entries
 	void rescale();
 
@@ -40,6 +61,9 @@ public:
 	// Increase frequency of context
 	inline const bool seen(const uint64);
 
+	// Set bit of follower in context
+	inline const bool set_follower(const uint64, const uint8);
+
 	// Bit vector with followers
 	inline const uint64 * get_follower_vec(const uint64);
 	
@@ -51,15 +75,32 @@ public:
 	// Hardware implementation:
 	// CRC32c hardware intrisics in i5/i7 or later
 	// h1 and h2 differ in taking different byte order 56781234 vs 12345678
+	// Tables larger than NarrowLimit take 64 bits from both byte orders
 	//
 	// Software implementation:
 	// FNV-1a and Jenkins one-at-a-time
-	inline const uint32 h1(const uint64) const;
-	inline const uint32 h2(const uint64) const;
+	//
+	// Second slot of fingerprint table is alt() of first slot
+	inline const uint64 h1(const uint64) const;
+	inline const uint64 h2(const uint64) const;
+
+	// Memory limit in bytes, grows from GrowStart MiB, fingerprint keys
+	cuckoo(const size_t, const bool, const bool);
+
+	// Overlay on read-only base
+	cuckoo(const cuckoo *);
 
-	cuckoo(const size_t);
 	~cuckoo();
 
+	// Count of slots changed in overlay
+	const size_t changed() const;
+
+	// Fraction of slots in use
+	const double load() const;
+
+	// Counters of hash operations (with STATS)
+	mutable stats counts;
+
 private:
 	cuckoo();
 	cuckoo(const cuckoo& old);
@@ -74,8 +115,25 @@ private:
 	// Recent insert(key) resulted in terminated loop or full bit vectors
 	bool is_full;
 
-	// Contexts in 64 bit int (1 byte of length, 7 bytes of context)
-	uint64 * keys;
+	// Contexts in 64 bit int (1 byte of length, 7 bytes of context or
+	// hash of longer context) or 16 bit fingerprint
+	uint8 * keys;
+
+	// Keys are fingerprints
+	bool fingerprint;
+
+	// Bytes of key
+	size_t keysize;
+
+	// Key of slot in array
+	inline const uint64 rawkey(const uint64) const;
+	inline void set_rawkey(const uint64, const uint64);
+
+	// Key as stored in slot: context or its fingerprint (never 0)
+	inline const uint64 tag(const uint64) const;
+
+	// Other slot of stored key in slot
+	inline const uint64 alt(const uint64, const uint64) const;
 
 	// Context frequency count
 	uint16 * values;
@@ -87,37 +145,102 @@ private:
 
 	// Check bits for follower in state
 	uint64 * follower_vecs;
-	uint32 follower_vecs_at;
-	uint32 follower_vecs_len;
+	uint64 follower_vecs_at;
+	uint64 follower_vecs_len;
 
 	// Previous follower index is used often, keep it for faster access 
 	mutable uint64 follower_lastkey;
-	mutable uint32 follower_lastidx;
+	mutable uint64 follower_lastidx;
+
+	// Bit vector with followers when changes are in overlay
+	uint64 follower_vec_copy[ (Alpha + 1) >> 6 ];
 
 	// Index of follower bit vector of context
-	inline const uint32 follower_idx(const uint64) const;
+	inline const uint64 follower_idx(const uint64) const;
+
+	// Frequency of context in overlay
+	const uint16 count_overlay(const uint64) const;
 
 	// Length of allocated keys and values 
 	size_t len;
 
-	// Set bit of follower in context
-	inline const bool set_follower(const uint64, const uint8);
+	// Length at start and at memory limit
+	size_t startlen;
+	size_t maxlen;
+
+	// Count of slots in memory of bytes
+	const size_t slots(const size_t) const;
+
+	// Double length up to memory limit and rehash, returns false
+	// when table is at memory limit
+	const bool grow();
+
+	// Reallocate arrays for length, contents are kept
+	void resize(const size_t);
+
+	// Put slot contents in slot, kicking others to their other slot;
+	// on failure arguments have the contents left over
+	inline const bool place(uint64, uint64&, uint16&, uint32&);
+
+	// Count of slots in use
+	size_t used;
+
+	// Hashes use 64 bits (table is larger than NarrowLimit)
+	bool wide;
+
+	// Map 64 bit hash to slot
+	inline const uint64 reduce(const uint64) const;
+
+	// Largest memory limit in MiB hashed with 32 bits, as in earlier
+	// versions: 32 bit hash modulo larger length is uneven
+	static const size_t NarrowLimit = 2048;
 
 	// Count of filled contexts (used for fill rate)
-	const uint32 filled() const;
+	const uint64 filled() const;
 
 	// Output verbose output to stderr when filled
 	const void filled_verbose() const;
 
-	// Key of parent context
-	inline const uint64 parent_key(const uint64) const;
-
 	// Bit vector offset for character
-	inline const uint32 off(const uint32, const uint8) const;
+	inline const uint64 off(const uint64, const uint8) const;
 
 	// Bit vector mask for character
 	inline const uint64 mask(const uint8) const;
 
+	// Counter bucket of kick chain length
+	inline const int kick_bucket(const uint32) const;
+
+	// Slot contents in overlay
+	struct slot {
+		uint64 key;
+		uint16 value;
+		uint32 follower;
+	};
+
+	// Changed slots and follower bit vector words (0 when not overlay)
+	overlay<slot> * slot_delta;
+	overlay<uint64> * vec_delta;
+
+	// Arrays are allocated by this table and not base
+	bool owned;
+
+	// Slot contents through overlay
+	inline const uint64 key_at(const uint64) const;
+	inline const uint16 value_at(const uint64) const;
+	inline const uint32 follower_at(const uint64) const;
+	inline const uint64 vec_at(const uint64) const;
+
+	// Change slot contents through overlay
+	inline void set_slot(const uint64, const uint64, const uint16, const uint32);
+	inline void inc_value(const uint64);
+	inline void set_vec_bits(const uint64, const uint64);
+
+	// Allocate arrays for length
+	void allocate();
+
+	// Stop using base, copying its contents with changes when asked
+	void detach(const bool);
+
 	// Constants for hashing functions
 	static const uint64 FNV_prime = 1099511628211ULL;
 	static const uint64 FNV_offset_basis = 14695981039346656037ULL;
@@ -130,15 +253,64 @@ private:
 
 };
 
-cuckoo::cuckoo(const size_t mem) {
-	len = (mem * 1 << 20) / 
-		(sizeof(uint64) // keys
+cuckoo::cuckoo(const size_t mem, const bool growing, 
+		const bool fingerprint_keys) 
+	: fingerprint(fingerprint_keys), keysize(fingerprint_keys ? 2 : 8),
+	  slot_delta(0), vec_delta(0), owned(false)
+{
+	wide = (mem > (NarrowLimit << 20));
+	maxlen = slots(mem);
+
+	// Follower index of slot is stored in 32 bits
+	if ((maxlen >> 1) > 0xFFFFFFFFULL) {
+		throw std::range_error("memory limit too large for follower index");
+	}
+
+	// Fingerprints can't be rehashed to a new length
+	startlen = (growing && !fingerprint 
+			? slots(std::min(mem, (size_t)GrowStart << 20)) : maxlen);
+	len = startlen;
+
+	// Since two hash functions give load factor of ~ 50%,
+	// is enough to have half as many slots for follower bit vectors
+	follower_vecs_len = (len >> 1);
+
+	allocate();
+	reset();
+}
+
+const size_t cuckoo::slots(const size_t mem) const {
+	return mem / 
+		(keysize // keys
 		+ sizeof(uint16)  // values
 		+ sizeof(uint32) // followers bitvector index
 		+ ( (((Alpha + 1) >> 6) * sizeof(uint64)) >> 1) ); // bitvector
+}
 
-	// 64bit context key
-	keys = (uint64 *) malloc(len * sizeof(uint64));
+cuckoo::cuckoo(const cuckoo * base)
+	: is_full(base->is_full), 
+	  keys(base->keys), fingerprint(base->fingerprint), 
+	  keysize(base->keysize), values(base->values), 
+	  followers(base->followers),
+	  follower_vecs(base->follower_vecs), 
+	  follower_vecs_at(base->follower_vecs_at),
+	  follower_vecs_len(base->follower_vecs_len),
+	  follower_lastkey(0), follower_lastidx(0),
+	  len(base->len), startlen(base->startlen), maxlen(base->maxlen),
+	  used(base->used), wide(base->wide),
+	  slot_delta(new overlay<slot>()), vec_delta(new overlay<uint64>()),
+	  owned(false)
+{
+#ifndef UNSAFE
+	if (base->slot_delta) {
+		throw std::logic_error("overlay on overlay");
+	}
+#endif
+}
+
+void cuckoo::allocate() {
+	// 64bit context key or 16bit fingerprint
+	keys = (uint8 *) malloc(len * keysize);
 	if (!keys) {
 		throw std::runtime_error("couldn't allocate cuckoo keys");
 	}
@@ -159,9 +331,6 @@ cuckoo::cuckoo(const size_t mem) {
 	}
 
 	// 256bit bit vectors for followers
-	// Since two hash functions give load factor of ~ 50%,
-	// is enough to have half as many slots for follower bit vectors
-	follower_vecs_len = (len >> 1);
 	follower_vecs = (uint64 *) malloc(follower_vecs_len 
 			* ((Alpha + 1) >> 6) * sizeof(uint64));
 	if (!follower_vecs) {
@@ -171,18 +340,235 @@ cuckoo::cuckoo(const size_t mem) {
 		throw std::runtime_error("couldn't allocate cuckoo follower vectors");
 	}
 
-	reset();
+	owned = true;
+}
+
+void cuckoo::resize(const size_t n) {
+	uint8 * k = (uint8 *) realloc(keys, n * keysize);
+	if (!k) {
+		throw std::runtime_error("couldn't resize cuckoo keys");
+	}
+	keys = k;
+
+	uint16 * v = (uint16 *) realloc(values, n * sizeof(uint16));
+	if (!v) {
+		throw std::runtime_error("couldn't resize cuckoo values");
+	}
+	values = v;
+
+	uint32 * f = (uint32 *) realloc(followers, n * sizeof(uint32));
+	if (!f) {
+		throw std::runtime_error("couldn't resize cuckoo followers");
+	}
+	followers = f;
+
+	uint64 * b = (uint64 *) realloc(follower_vecs, (n >> 1) 
+			* ((Alpha + 1) >> 6) * sizeof(uint64));
+	if (!b) {
+		throw std::runtime_error("couldn't resize cuckoo follower vectors");
+	}
+	follower_vecs = b;
+
+	len = n;
+	follower_vecs_len = (n >> 1);
+}
+
+const bool cuckoo::grow() {
+	if (len >= maxlen)
+		return false;
+
+	profile::timer t(PhaseGrow);
+	STAT( ++counts.grows; )
+
+	// Base is shared, copy it with changes
+	detach(true);
+
+	const size_t oldlen = len;
+	const uint64 oldvecs = follower_vecs_len;
+	resize(std::min(len << 1, maxlen));
+	memset(keys + oldlen * keysize, 0, (len - oldlen) * keysize);
+	memset(values + oldlen, 0, (len - oldlen) * sizeof(uint16));
+	memset(followers + oldlen, 0, (len - oldlen) * sizeof(uint32));
+	memset(follower_vecs + oldvecs * ((Alpha + 1) >> 6), 0, 
+			(follower_vecs_len - oldvecs) * ((Alpha + 1) >> 6) 
+			* sizeof(uint64));
+	follower_lastkey = 0;
+	follower_lastidx = 0;
+
+	// Move entries to their slots in new length. Follower vectors
+	// keep their index. Entry kicked ahead of the scan is already
+	// in its slot when reached.
+	for (size_t i = 0 ; i < oldlen ; ++i) {
+		uint64 key = rawkey(i);
+		if (key == 0 || h1(key) == i || h2(key) == i)
+			continue;
+		uint16 value = values[i];
+		uint32 follower = followers[i];
+		set_rawkey(i, 0);
+		values[i] = 0;
+		followers[i] = 0;
+		--used;
+		if (!place(h1(key), key, value, follower)) {
+			// Entry left over is lost, table is reset as full
+			is_full = true;
+			break;
+		}
+	}
+	return true;
 }
 
 cuckoo::~cuckoo() {
-	free(keys);
-	free(values);
-	free(followers);
-	free(follower_vecs);
+	if (owned) {
+		free(keys);
+		free(values);
+		free(followers);
+		free(follower_vecs);
+	}
+	delete slot_delta;
+	delete vec_delta;
+}
+
+void cuckoo::detach(const bool copy) {
+	if (!slot_delta)
+		return;
+
+	const uint8 * base_keys = keys;
+	const uint16 * base_values = values;
+	const uint32 * base_followers = followers;
+	const uint64 * base_vecs = follower_vecs;
+
+	allocate();
+
+	if (copy) {
+		memcpy(keys, base_keys, len * keysize);
+		memcpy(values, base_values, len * sizeof(uint16));
+		memcpy(followers, base_followers, len * sizeof(uint32));
+		memcpy(follower_vecs, base_vecs, follower_vecs_len 
+				* ((Alpha + 1) >> 6) * sizeof(uint64));
+		slot_delta->each([this](const uint64 p, const slot& e) {
+			set_rawkey(p, e.key);
+			values[p] = e.value;
+			followers[p] = e.follower;
+		});
+		vec_delta->each([this](const uint64 o, const uint64 v) {
+			follower_vecs[o] = v;
+		});
+	}
+
+	delete slot_delta;
+	delete vec_delta;
+	slot_delta = 0;
+	vec_delta = 0;
+}
+
+const size_t cuckoo::changed() const {
+	return (slot_delta ? slot_delta->size() : 0);
+}
+
+const uint64 cuckoo::key_at(const uint64 p) const {
+	if (slot_delta) {
+		const slot * e = slot_delta->find(p);
+		if (e)
+			return e->key;
+	}
+	return rawkey(p);
+}
+
+const uint64 cuckoo::rawkey(const uint64 p) const {
+	return (fingerprint ? ((const uint16 *) keys)[p] 
+			: ((const uint64 *) keys)[p]);
+}
+
+void cuckoo::set_rawkey(const uint64 p, const uint64 k) {
+	if (fingerprint)
+		((uint16 *) keys)[p] = k;
+	else
+		((uint64 *) keys)[p] = k;
+}
+
+const uint64 cuckoo::tag(const uint64 key) const {
+	if (!fingerprint)
+		return key;
+	// High bits of multiplicative hash, independent of slot
+	const uint64 t = ((key * 0x9E3779B97F4A7C15ULL) >> 48);
+	return (t == 0 ? 1 : t);
+}
+
+const uint64 cuckoo::alt(const uint64 pos, const uint64 t) const {
+	if (!fingerprint) {
+		const uint64 a = h1(t);
+		return (pos == a ? h2(t) : a);
+	}
+	// Reflection about hash of fingerprint: other slot of other slot 
+	// is the slot, for any length
+	const uint64 a = reduce(t * 0xC2B2AE3D27D4EB4FULL) + len - pos;
+	return (a >= len ? a - len : a);
+}
+
+const uint16 cuckoo::value_at(const uint64 p) const {
+	if (slot_delta) {
+		const slot * e = slot_delta->find(p);
+		if (e)
+			return e->value;
+	}
+	return values[p];
+}
+
+const uint32 cuckoo::follower_at(const uint64 p) const {
+	if (slot_delta) {
+		const slot * e = slot_delta->find(p);
+		if (e)
+			return e->follower;
+	}
+	return followers[p];
+}
+
+const uint64 cuckoo::vec_at(const uint64 o) const {
+	if (vec_delta) {
+		const uint64 * e = vec_delta->find(o);
+		if (e)
+			return *e;
+	}
+	return follower_vecs[o];
+}
+
+void cuckoo::set_slot(const uint64 p, const uint64 key, const uint16 value,
+		const uint32 follower)
+{
+	if (slot_delta) {
+		slot e = { key, value, follower };
+		slot_delta->get(p, e) = e;
+		return;
+	}
+	set_rawkey(p, key);
+	values[p] = value;
+	followers[p] = follower;
+}
+
+void cuckoo::inc_value(const uint64 p) {
+	if (slot_delta) {
+		slot e = { rawkey(p), values[p], followers[p] };
+		++slot_delta->get(p, e).value;
+		return;
+	}
+	++values[p];
+}
+
+void cuckoo::set_vec_bits(const uint64 o, const uint64 bits) {
+	if (vec_delta) {
+		vec_delta->get(o, follower_vecs[o]) |= bits;
+		return;
+	}
+	follower_vecs[o] |= bits;
 }
 
 void cuckoo::reset() {
-	memset(keys, 0, len * sizeof(uint64));
+	profile::timer t(PhaseReset);
+
+	// Overlay is no longer needed when base is dropped
+	detach(false);
+
+	memset(keys, 0, len * keysize);
 	memset(values, 0, len * sizeof(uint16));
 	memset(followers, 0, len * sizeof(uint32));
 	memset(follower_vecs, 0, follower_vecs_len * ((Alpha + 1) >> 6) 
@@ -191,40 +577,91 @@ void cuckoo::reset() {
 	follower_lastkey = 0;
 	follower_lastidx = 0;
 	is_full = false;
+	used = 0;
 
 	// 0th order
 	seen(RootKey);
 }
 
+void cuckoo::clear() {
+	detach(false);
+	if (len != startlen)
+		resize(startlen);
+	reset();
+}
+
 const uint16 cuckoo::count(const uint64 key) const {
-	uint32 a = h1(key);
-	if (keys[a] == key)
+	if (slot_delta)
+		return count_overlay(key);
+	STAT( ++counts.probes; )
+	const uint64 t = tag(key);
+	uint64 a = h1(key);
+	if (rawkey(a) == t) {
+		STAT( ++counts.hits_h1; )
 		return values[a];
-	uint32 b = h2(key);
-	if (keys[b] == key)
+	}
+	STAT( ++counts.probes; )
+	uint64 b = (fingerprint ? alt(a, t) : h2(key));
+	if (rawkey(b) == t) {
+		STAT( ++counts.hits_h2; )
 		return values[b];
+	}
+	return 0;
+}
+
+const uint16 cuckoo::count_overlay(const uint64 key) const {
+	STAT( ++counts.probes; )
+	const uint64 t = tag(key);
+	uint64 a = h1(key);
+	if (key_at(a) == t) {
+		STAT( ++counts.hits_h1; )
+		return value_at(a);
+	}
+	STAT( ++counts.probes; )
+	uint64 b = (fingerprint ? alt(a, t) : h2(key));
+	if (key_at(b) == t) {
+		STAT( ++counts.hits_h2; )
+		return value_at(b);
+	}
 	return 0;
 }
 
-const uint32 cuckoo::follower_idx(const uint64 key) const {
+const uint64 cuckoo::follower_idx(const uint64 key) const {
 	if (key == follower_lastkey)
 		return follower_lastidx;
 
-	uint32 a = h1(key);
-	if (keys[a] == key) {
+	STAT( ++counts.probes; )
+	const uint64 t = tag(key);
+	uint64 a = h1(key);
+	if (key_at(a) == t) {
+		STAT( ++counts.hits_h1; )
 		follower_lastkey = key;
-		return follower_lastidx = followers[a];
+		return follower_lastidx = follower_at(a);
 	}
-	uint32 b = h2(key);
-	if (keys[b] == key) {
+	STAT( ++counts.probes; )
+	uint64 b = (fingerprint ? alt(a, t) : h2(key));
+	if (key_at(b) == t) {
+		STAT( ++counts.hits_h2; )
 		follower_lastkey = key;
-		return follower_lastidx = followers[b];
+		return follower_lastidx = follower_at(b);
 	}
 	return 0;
 }
 
 const bool cuckoo::contains(const uint64 key) const {
-	return (keys[h1(key)] == key || keys[h2(key)] == key);
+	STAT( ++counts.probes; )
+	const uint64 t = tag(key);
+	const uint64 a = h1(key);
+	if (key_at(a) == t) {
+		STAT( ++counts.hits_h1; )
+		return true;
+	}
+	STAT( ++counts.probes; )
+	if (key_at(fingerprint ? alt(a, t) : h2(key)) == t) {
+		STAT( ++counts.hits_h2; )
+		return true;
+	}
+	return false;
 }
 
 const bool cuckoo::insert(uint64 key) {
@@ -237,51 +674,71 @@ const bool cuckoo::insert(uint64 key) {
 	}
 
 	// No more space for follower bit vectors
-	if (follower_vecs_at >= follower_vecs_len - 1) {
+	if (follower_vecs_at >= follower_vecs_len - 1 && (!grow() || full())) {
 		is_full = true;
+		STAT( ++counts.resets_followers; )
 #ifdef VERBOSE
 		filled_verbose();
 #endif
 		return false;
 	}
 
-	// Loop at most MaxLoop times
-	uint32 pos = h1(key);
 	uint16 value = 0;
 	uint32 follower = follower_vecs_at;
 	++follower_vecs_at;
 
+	// Grow table and place the contents left over, which is a
+	// context key since table of fingerprints doesn't grow
+	uint64 stored = tag(key);
+	uint64 pos = h1(key);
+	while (!place(pos, stored, value, follower)) {
+		if (grow() && !full()) {
+			pos = h1(stored);
+			continue;
+		}
+
+		// maxloop terminated marker
+		is_full = true; 
+		STAT( ++counts.resets_maxloop; )
+
+#ifdef VERBOSE
+		filled_verbose();
+#endif
+
+		return false;
+	}
+	return true;
+}
+
+const bool cuckoo::place(uint64 pos, uint64& key, uint16& value, 
+		uint32& follower) 
+{
+	// Loop at most MaxLoop times
 	for (size_t n = 0 ; n < MaxLoop ; ++n) {
 		// Found an empty bucket
-		if (keys[pos] == 0) { 
-			keys[pos] = key; 
-			values[pos] = value;
-			followers[pos] = follower;
+		uint64 kicked = key_at(pos);
+		if (kicked == 0) { 
+			set_slot(pos, key, value, follower);
+			++used;
+			STAT( ++counts.kicks[ kick_bucket(n) ]; )
 			return true;
 		}
 
 		// Kick a can down the road
-		std::swap(key, keys[pos]);
-		std::swap(value, values[pos]);
-		std::swap(follower, followers[pos]);
-		if (pos == h1(key)) 
-			pos = h2(key);
-		else 
-			pos = h1(key);
+		uint16 kicked_value = value_at(pos);
+		uint32 kicked_follower = follower_at(pos);
+		set_slot(pos, key, value, follower);
+		key = kicked;
+		value = kicked_value;
+		follower = kicked_follower;
+		pos = alt(pos, key);
 	}
-
-	// maxloop terminated marker
-	is_full = true; 
-
-#ifdef VERBOSE
-	filled_verbose();
-#endif
-
+	STAT( ++counts.kicks[ kick_bucket(MaxLoop) ]; )
 	return false;
 }
 
 const void cuckoo::filled_verbose() const {
-	uint32 fill = filled();
+	uint64 fill = filled();
 	float rate = (float)fill/len * 100;
 	std::cerr << "reset with load factor " << std::fixed 
 			<< std::setprecision(3) << rate << "% "
@@ -299,39 +756,43 @@ const bool cuckoo::seen(const uint64 key) {
 	if (key == RootKey)
 		return true;
 
-	uint32 a = h1(key);
-	if (keys[a] == key)
-		++values[a];
+	const uint64 t = tag(key);
+	uint64 a = h1(key);
+	if (key_at(a) == t)
+		inc_value(a);
 	else
-		++values[h2(key)];
-
-	// Set bit for this node in parent context bit vector
-	set_follower(parent_key(key), (key & 0xFF));
+		inc_value(fingerprint ? alt(a, t) : h2(key));
 	
 	return true;
 }
 
 const uint64 * cuckoo::get_follower_vec(const uint64 key) {
 	// index at 0 is empty
-	uint32 p = follower_idx(key);
+	uint64 p = follower_idx(key);
 #ifdef DEBUG
 	assert (p != 0);
 #endif
+	// Overlay gives copy of bit vector
+	if (vec_delta) {
+		for (int i = 0 ; i < ((Alpha + 1) >> 6) ; ++i)
+			follower_vec_copy[i] = vec_at(off(p,0) + i);
+		return follower_vec_copy;
+	}
 	return (follower_vecs + off(p,0));
 }
 
 const bool cuckoo::has_follower(const uint64 key, const uint8 c) {
-	uint32 p = follower_idx(key);
+	uint64 p = follower_idx(key);
 	if (p == 0)
 		return false;
-	return (mask(c) & follower_vecs[off(p,c)]);
+	return (mask(c) & vec_at(off(p,c)));
 }
 
 const bool cuckoo::set_follower(const uint64 key, const uint8 c) {
-	uint32 p = follower_idx(key);
+	uint64 p = follower_idx(key);
 	if (p == 0)
 		return false;
-	follower_vecs[off(p,c)] |= mask(c);
+	set_vec_bits(off(p,c), mask(c));
 #ifdef DEBUG
 	assert(has_follower(key,c));
 #endif
@@ -343,9 +804,13 @@ const bool cuckoo::full() const {
 }
 
 void cuckoo::rescale() {
+	profile::timer t(PhaseRescale);
 #ifdef VERBOSE
 	std::cerr << "rescale" << std::endl; 
 #endif
+	// Every value changes, overlay would copy all of base
+	detach(true);
+
 	for (size_t i = 0 ; i < len ; ++i) {
 #ifdef RESCALE_MIN_1
 		if (values[i] == 0)
@@ -361,25 +826,28 @@ void cuckoo::rescale() {
 	}
 }
 
-const uint32 cuckoo::filled() const {
-	int filled = 0;
-	for (size_t p = 0 ; p<len ; ++p) {
-		if (keys[p] == 0)
-			continue;
-		++filled;
-	}
-	return filled;
+const uint64 cuckoo::filled() const {
+	return used;
 }
 
-const uint32 cuckoo::h1(const uint64 key) const {
+const double cuckoo::load() const {
+	return (double)used / len;
+}
+
+const uint64 cuckoo::h1(const uint64 key) const {
 #ifdef BUILTIN_CRC
 	const uint32 * p = ((const uint32 *) &key);
 	uint32 crc = CRCInit;
 	crc = __builtin_ia32_crc32si(crc, *(p + 1));
 	crc = __builtin_ia32_crc32si(crc, *(p));
+	if (wide) {
+		uint32 low = __builtin_ia32_crc32si(CRCInit, *(p));
+		low = __builtin_ia32_crc32si(low, *(p + 1));
+		return reduce(((uint64)crc << 32) | low);
+	}
 	return (crc % len);
 #else
-	// FNV-1a
+	// FNV-1a (64 bit hash for all table lengths)
 	// @see https://en.wikipedia.org/wiki/Fowler%E2%80%93Noll%E2%80%93Vo_hash_function
 	uint64 hash = FNV_offset_basis;
 	for (int i = 0 ; i < 8 ; ++i) { // -funrolled
@@ -389,12 +857,17 @@ const uint32 cuckoo::h1(const uint64 key) const {
 #endif
 }
 
-const uint32 cuckoo::h2(const uint64 key) const {
+const uint64 cuckoo::h2(const uint64 key) const {
 #ifdef BUILTIN_CRC
 	const uint32 * p = ((const uint32 *) &key);
 	uint32 crc = CRCInit;
 	crc = __builtin_ia32_crc32si(crc, *(p));
 	crc = __builtin_ia32_crc32si(crc, *(p + 1));
+	if (wide) {
+		uint32 low = __builtin_ia32_crc32si(CRCInit, *(p + 1));
+		low = __builtin_ia32_crc32si(low, *(p));
+		return reduce(((uint64)crc << 32) | low);
+	}
 	return (crc % len);
 #else
 	// Jenkins one-at-a-time
@@ -408,25 +881,34 @@ const uint32 cuckoo::h2(const uint64 key) const {
 	hash += (hash << 3);
 	hash ^= (hash >> 11);
 	hash += (hash << 15);
+	// Low 32 bits from multiplicative hash of key
+	if (wide)
+		return reduce(((uint64)hash << 32) 
+				| ((key * 0x9E3779B97F4A7C15ULL) >> 32));
 	return (hash % len);
 #endif
 }
 
-const uint32 cuckoo::off(const uint32 p, const uint8 c) const {
-	const uint32 off = (((Alpha + 1) >> 6) * p + (c >> 6));
+const uint64 cuckoo::reduce(const uint64 hash) const {
+	// High word of product is evenly in [0,len)
+	return (uint64)(((unsigned __int128)hash * len) >> 64);
+}
+
+const uint64 cuckoo::off(const uint64 p, const uint8 c) const {
+	const uint64 off = (((Alpha + 1) >> 6) * p + (c >> 6));
 #ifdef DEBUG
 	assert(off < follower_vecs_len);
 #endif
 	return off;
 }
 
-const uint64 cuckoo::mask(const uint8 c) const {
-	return (1ULL << (0x3F - (c & 0x3F)));
+const int cuckoo::kick_bucket(const uint32 n) const {
+	int b = (n == 0 ? 0 : 32 - __builtin_clz(n));
+	return (b < KickBuckets ? b : KickBuckets - 1);
 }
 
-const uint64 cuckoo::parent_key(const uint64 key) const {
-	return (((0xFF00000000000000ULL & key) - (1ULL << 56)) 
-		| ((0x00FFFFFFFFFFFFFFULL & key) >> 8));
+const uint64 cuckoo::mask(const uint8 c) const {
+	return (1ULL << (0x3F - (c & 0x3F)));
 }
 
 } // namespace
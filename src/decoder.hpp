@@ -26,9 +26,18 @@ public:
 	// Encoder symbol using distribution
 	inline const uint16 decode(const uint32[]);
 
+	// Decode a bit, 1 has frequency out of BitTotal
+	inline const bool decode_bit(const uint32);
+
+	// Decode a positive integer as bit length and bits
+	const uint64 decode_int();
+
 	// End of data reached
 	inline const bool eof();
 
+	// Sync flush point: skip to byte boundary and restart code region
+	void sync();
+
 	decoder(std::istream&);
 	~decoder();
 private:
@@ -47,8 +56,20 @@ private:
 	// Code word that is currently being decoded
 	uint64 value;
 
+	// Frequency of code value out of total
+	inline const uint32 target(const uint32) const;
+
+	// Narrow code region to range of total
+	inline void narrow(const uint32, const uint32, const uint32);
+
+	// Consume bits of code region
+	inline void shift();
+
 	// Bit output
 	inline const bool bit_read();
+
+	// Read initial code value
+	inline void start();
 	uint16 bitp;
 	uint8 byte;
 };
@@ -59,28 +80,19 @@ const uint16 decoder::decode(const uint32 dist[]) {
 
 	// Symbol to be decoded
 	uint16 c;
-	// Size of the current code region
-	uint64 range = (uint64) (high - low) + 1;
 	// Frequency for value in range
-	uint32 freq = (uint32) ((((value - low) + 1) 
-		* dist[ R(EOS) ] - 1) / range);
+	uint32 freq = target(dist[ R(EOS) ]);
 
 	// Then find symbol
 	for (c = 0; c <= EOS + 1 ; ++c)
 		if (dist[ R(c) ] > freq)
 			break;
 
-	// Don't consume input after EOS
-	if (c == EOS) {
-		return c;
-	}
-
 	// Narrow the code region to that allotted to this symbol.
-	high = low + (range * dist[ R(c) ]) / dist[ R(EOS) ] - 1;
-	low = low + (range * dist[ L(c) ]) / dist[ R(EOS) ];
+	narrow(dist[ L(c) ], dist[ R(c) ], dist[ R(EOS) ]);
 
 #ifdef DEBUG
-	std::cerr << "decode\t" << range 
+	std::cerr << "decode" 
 		<< "\t< " << dist[ L(c) ] << " , " << dist[ R(c) ] << " > " 
 		<< "\t < " << low << " , " << high << " > " ;
 	if (c == 256)
@@ -90,7 +102,53 @@ const uint16 decoder::decode(const uint32 dist[]) {
 	else
 		std::cerr << "\t " << c << std::endl;
 #endif
+	shift();
+
+	return c;
+}
+
+const bool decoder::decode_bit(const uint32 freq) {
+	if (eof())
+		return false;
+
+	// Bit 1 has range [0,freq) and 0 has [freq,BitTotal)
+	bool bit = (target(BitTotal) < freq);
+	narrow(bit ? 0 : freq, bit ? freq : BitTotal, BitTotal);
+#ifdef DEBUG
+	std::cerr << "decode\t< " << freq << " / " << BitTotal << " > " 
+		<< "\t < " << low << " , " << high << " > " 
+		<< "\t bit " << bit << std::endl;
+#endif
+	shift();
+
+	return bit;
+}
 
+const uint64 decoder::decode_int() {
+	// Bit length in 6 bits, then bits below the highest
+	int n = 0;
+	for (int i = 0 ; i < 6 ; ++i)
+		n = ((n << 1) | decode_bit(BitTotal >> 1));
+	uint64 v = 1;
+	for (int i = 0 ; i < n ; ++i)
+		v = ((v << 1) | decode_bit(BitTotal >> 1));
+	return v;
+}
+
+const uint32 decoder::target(const uint32 total) const {
+	// Size of the current code region
+	uint64 range = (uint64) (high - low) + 1;
+	return (uint32) ((((value - low) + 1) * total - 1) / range);
+}
+
+void decoder::narrow(const uint32 lo, const uint32 hi, const uint32 total) {
+	// Size of the current code region
+	uint64 range = (uint64) (high - low) + 1;
+	high = low + (range * hi) / total - 1;
+	low = low + (range * lo) / total;
+}
+
+void decoder::shift() {
 	// Consume bits
 	while (true) {
 		// Matching most significant bit, shift out
@@ -122,8 +180,6 @@ const uint16 decoder::decode(const uint32 dist[]) {
 			<< std::endl;
 #endif
 	}
-
-	return c;
 }
 
 const bool decoder::eof() {
@@ -139,13 +195,26 @@ const bool decoder::bit_read() {
 	return ((byte & (1 << --bitp)) >= 1);
 }
 
+void decoder::start() {
+	// Initial code range
+	low = 0;
+	high = TopValue;
+	value = 0;
+	for (int i = 0 ; (i < CodeValueBits >> 3) ; ++i)
+		value = (value << 8) | (in.get() & 0xFF);
+}
+
+void decoder::sync() {
+	// Rest of the byte is padding
+	bitp = 0;
+	start();
+}
+
 decoder::decoder(std::istream& proxy)
 	: eofreached(false), in(proxy), low(0), high(TopValue), value(0),
 	  bitp(0), byte(0)
 {
-	// Initial code range
-	for (int i = 0 ; (i < CodeValueBits >> 3) ; ++i)
-		value = (value << 8) | in.get();
+	start();
 }
 
 decoder::~decoder() {
@@ -0,0 +1,261 @@
+/**
+ * Long-range deduplication ahead of the model. Input is kept in a
+ * window of up to gigabytes, and a rolling hash of DedupMin bytes
+ * marks anchor positions by content. Anchors are recorded in a hash
+ * table, so a run of DedupMin bytes seen anywhere in the window is
+ * found again at its first anchor. Duplicate runs are extended as
+ * input arrives and output as references of distance and length;
+ * other bytes are output as literals for the model.
+ *
+ * Decompressor keeps the same window without the hash table and
+ * copies references from it.
+ *
+ * @author jkataja
+ */
+
+#pragma once
+
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "pompom.hpp"
+#include "pompomdefs.hpp"
+
+namespace pompom {
+
+class dedup {
+public:
+	// Output of next(): nothing ready or reference
+	static const int None = -1;
+	static const int Reference = 256;
+
+	// Add input byte
+	inline void push(const uint8);
+
+	// Next literal byte, Reference with distance and length, or None
+	inline const int next(uint64&, uint64&);
+
+	// Output pending reference and lookahead before sync or end
+	void flush();
+
+	// Add decoded byte to window
+	inline void append(const uint8);
+
+	// Byte at distance back in window
+	inline const uint8 at(const uint64) const;
+
+	// Distance is in window
+	inline const bool valid(const uint64) const;
+
+	// Frequency of reference out of BitTotal
+	inline const uint32 reffreq() const;
+
+	// Adapt probability of reference after literal or reference
+	inline void coded(const bool);
+
+	// Count of bytes in references
+	const uint64 copied() const;
+
+	// MiB of window of MiB and its hash table when parsing input
+	static const int footprint(const int, const bool);
+
+	// Window of MiB; hash table only for parsing input
+	dedup(const size_t, const bool);
+	~dedup();
+private:
+	dedup();
+	dedup(const dedup&);
+	const dedup& operator=(const dedup&);
+
+	// Window of length mask + 1 (power of two)
+	uint8 * window;
+	uint64 mask;
+
+	// Position of anchor by hash, 2^tablebits entries
+	uint32 * table;
+	int tablebits;
+
+	// Count of bytes added and bytes output as literal or reference
+	uint64 inpos;
+	uint64 outpos;
+
+	// Rolling hash of last DedupMin bytes
+	uint32 hash;
+
+	// HashMul to the power of DedupMin, removes oldest byte from hash
+	uint32 hashout;
+
+	// Reference being extended: source position and length
+	bool copying;
+	uint64 src;
+	uint64 len;
+
+	// Lookahead before position is output as literals
+	uint64 drainpos;
+
+	// Reference ready for output
+	bool ready;
+	uint64 refdist;
+	uint64 reflen;
+
+	// Probability of reference, 16 bits
+	uint16 prob;
+
+	// Count of bytes in references
+	uint64 copylen;
+
+	// Multiplier of rolling hash
+	static const uint32 HashMul = 0x01000193;
+};
+
+dedup::dedup(const size_t mem, const bool parse)
+	: table(0), tablebits(0), inpos(0), outpos(0), hash(0),
+	  copying(false), src(0), len(0), drainpos(0), ready(false), 
+	  refdist(0), reflen(0), prob(1 << 11), copylen(0)
+{
+	size_t windowlen = 1;
+	while ((windowlen << 1) <= (mem << 20))
+		windowlen <<= 1;
+	mask = windowlen - 1;
+	window = (uint8 *) malloc(windowlen);
+	if (window == 0)
+		throw std::bad_alloc();
+
+	// One anchor in DedupAnchor bytes on average
+	if (parse) {
+		tablebits = 0;
+		while (((uint64)1 << (tablebits + 1)) * DedupAnchor <= windowlen
+				&& tablebits < 28)
+			++tablebits;
+		table = (uint32 *) calloc((size_t)1 << tablebits, sizeof(uint32));
+		if (table == 0) {
+			free(window);
+			throw std::bad_alloc();
+		}
+	}
+
+	hashout = 1;
+	for (int i = 0 ; i < DedupMin ; ++i)
+		hashout *= HashMul;
+}
+
+dedup::~dedup() {
+	free(window);
+	free(table);
+}
+
+void dedup::push(const uint8 c) {
+	window[inpos & mask] = c;
+	++inpos;
+
+	// Extend reference, or make it ready at first differing byte
+	if (copying) {
+		if (len < DedupMaxLen && window[(src + len) & mask] == c)
+			++len;
+		else {
+			ready = true;
+			refdist = outpos - src;
+			reflen = len;
+			outpos += len;
+			copying = false;
+		}
+	}
+
+	// Roll hash over last DedupMin bytes
+	hash = (hash * HashMul) + c + 1;
+	if (inpos > (uint64)DedupMin)
+		hash -= hashout * (window[(inpos - DedupMin - 1) & mask] + 1);
+	if (inpos < (uint64)DedupMin)
+		return;
+
+	// Anchor by bits below table index
+	uint32 h = (hash * 0x9E3779B1);
+	if (((h >> (28 - tablebits)) & (DedupAnchor - 1)) != 0)
+		return;
+
+	uint32& last = table[ h >> (32 - tablebits) ];
+	const uint64 start = inpos - DedupMin;
+
+	// Lookahead starts with anchor: seek earlier run
+	if (!copying && !ready && start == outpos) {
+		uint64 d = (uint32)((uint32)start - last);
+		if (d > 0 && d <= start && d + DedupMin <= mask) {
+			int i = 0;
+			for ( ; i < DedupMin ; ++i)
+				if (window[(start + i) & mask]
+						!= window[(start - d + i) & mask])
+					break;
+			if (i == DedupMin) {
+				copying = true;
+				src = start - d;
+				len = DedupMin;
+			}
+		}
+	}
+	last = (uint32)start;
+}
+
+const int dedup::next(uint64& dist, uint64& n) {
+	if (ready) {
+		ready = false;
+		dist = refdist;
+		n = reflen;
+		copylen += reflen;
+		return Reference;
+	}
+	// Literal when lookahead is full and no run starts from it
+	if (!copying && (inpos - outpos >= (uint64)DedupMin 
+				|| outpos < drainpos))
+		return window[(outpos++) & mask];
+	return None;
+}
+
+void dedup::flush() {
+	if (copying) {
+		ready = true;
+		refdist = outpos - src;
+		reflen = len;
+		outpos += len;
+		copying = false;
+	}
+	// Lookahead is output as literals
+	drainpos = inpos;
+}
+
+void dedup::append(const uint8 c) {
+	window[inpos & mask] = c;
+	++inpos;
+}
+
+const uint8 dedup::at(const uint64 dist) const {
+	return window[(inpos - dist) & mask];
+}
+
+const bool dedup::valid(const uint64 dist) const {
+	return (dist > 0 && dist <= inpos && dist <= mask);
+}
+
+const uint32 dedup::reffreq() const {
+	// Neither case has zero frequency
+	uint32 f = (prob >> (16 - BitTotalBits));
+	return (f < 1 ? 1 : f);
+}
+
+void dedup::coded(const bool ref) {
+	if (ref)
+		prob += ((65536 - prob) >> DedupRate);
+	else
+		prob -= (prob >> DedupRate);
+}
+
+const uint64 dedup::copied() const {
+	return copylen;
+}
+
+const int dedup::footprint(const int mem, const bool parse) {
+	// Table has an entry of 4 bytes for DedupAnchor bytes of window
+	return mem + (parse ? (mem * 4 + DedupAnchor - 1) / DedupAnchor : 0);
+}
+
+} // namespace
@@ -0,0 +1,90 @@
+/**
+ * Direct-mapped cache of symbol frequencies of recently coded contexts.
+ * Entry keeps follower bit vector and frequency of each follower of
+ * context, so distribution of a hot context is built without probing
+ * the context table. Model patches entry of context when a count in it
+ * changes, and clears the cache when all counts change on rescale or
+ * reset.
+ *
+ * @author jkataja
+ */
+
+#pragma once
+
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "pompom.hpp"
+#include "pompomdefs.hpp"
+
+namespace pompom {
+
+class distcache {
+public:
+	// Cached context: key of context, followers and their frequencies
+	struct entry {
+		uint64 key;
+		uint64 vec[ (Alpha + 1) >> 6 ];
+		uint16 freq[ Alpha + 1 ];
+	};
+
+	// Entry of context, or 0 when not cached
+	inline entry * find(const uint64);
+
+	// Entry for context in place of entry in its slot
+	inline entry * put(const uint64);
+
+	// Forget all entries
+	void clear();
+
+	// Cache of 2^bits entries
+	distcache(const int);
+	~distcache();
+private:
+	distcache();
+	distcache(const distcache&);
+	const distcache& operator=(const distcache&);
+
+	// Slot of context
+	inline const uint64 slot(const uint64) const;
+
+	entry * entries;
+	const int bits;
+};
+
+distcache::distcache(const int n)
+	: bits(n)
+{
+	entries = (entry *) malloc(((size_t)1 << bits) * sizeof(entry));
+	if (entries == 0)
+		throw std::bad_alloc();
+	clear();
+}
+
+distcache::~distcache() {
+	free(entries);
+}
+
+void distcache::clear() {
+	// Key is never 0, first bit of length is set
+	for (size_t i = 0 ; i < ((size_t)1 << bits) ; ++i)
+		entries[i].key = 0;
+}
+
+const uint64 distcache::slot(const uint64 key) const {
+	return ((key * 0x9E3779B97F4A7C15ULL) >> (64 - bits));
+}
+
+distcache::entry * distcache::find(const uint64 key) {
+	entry * e = entries + slot(key);
+	return (e->key == key ? e : 0);
+}
+
+distcache::entry * distcache::put(const uint64 key) {
+	entry * e = entries + slot(key);
+	e->key = key;
+	return e;
+}
+
+} // namespace
@@ -20,6 +20,7 @@
 #include <iostream>
 
 #include "pompomdefs.hpp"
+#include "profile.hpp"
 
 namespace pompom {
 
@@ -28,12 +29,22 @@ public:
 	// Encode a symbol.
 	inline void encode(const uint16, const uint32[]);
 
-	// Length of output byte
+	// Encode a bit, 1 has frequency out of BitTotal
+	inline void encode_bit(const bool, const uint32);
+
+	// Encode a positive integer as bit length and bits
+	void encode_int(const uint64);
+
+	// Length of output bytes, including bytes not yet written
 	const uint64 len() const;
 
 	// Write bit buffer and closing fluff
 	void finish();
 
+	// Sync flush: write pending bits on byte boundary and restart
+	// the code region, so all symbols so far can be decoded
+	void sync();
+
 	encoder(std::ostream&);
 	~encoder();
 private:
@@ -49,6 +60,9 @@ private:
 	uint8 byte;
 	uint64 outlen;
 
+	// Output length at start of current code segment
+	uint64 segment;
+
 	// High end of the current code region
 	uint64 high;
 
@@ -58,14 +72,23 @@ private:
 	// Number of byte to follow next
 	uint64 bits_to_follow;
 
+	// Narrow code region to range of total
+	inline void narrow(const uint32, const uint32, const uint32);
+
+	// Output bits of code region
+	inline void shift();
+
 	inline void bit_plus_follow(const bool);
 	inline void bit_write(const bool);
 	inline void flush_bits();
 	inline void flush();
+
+	// Close code segment on byte boundary
+	void terminate();
 };
 
 encoder::encoder(std::ostream& proxy)
-	: out(proxy), p(0), bitp(0), byte(0), outlen(0),
+	: out(proxy), p(0), bitp(0), byte(0), outlen(0), segment(0),
 	  high(TopValue), low(0), bits_to_follow(0) 
 {
 	buf = new char[WriteBufSize];
@@ -83,15 +106,10 @@ void encoder::encode(const uint16 c, const uint32 * dist) {
 	}
 #endif
 
-	// Size of the current code region
-	uint64 range = (uint64) (high - low) + 1;
 	// Narrow the code region  to that allocated to this symbol
-	uint32 totalrange = dist[ R(EOS) ];
-	high = low + ((range * dist[ R(c)] ) / totalrange) - 1;
-	low = low + ((range * dist[ L(c)] ) / totalrange);
-
+	narrow(dist[ L(c) ], dist[ R(c) ], dist[ R(EOS) ]);
 #ifdef DEBUG
-	std::cerr << "encode\t" << range 
+	std::cerr << "encode" 
 		<< "\t< " << dist[ L(c) ] << " , " << dist[ R(c) ] << " > " 
 		<< "\t < " << low << " , " << high << " > ";
 	if (c == 256)
@@ -101,7 +119,37 @@ void encoder::encode(const uint16 c, const uint32 * dist) {
 	else
 		std::cerr << "\t " << c << std::endl;
 #endif
+	shift();
+}
+
+void encoder::encode_bit(const bool bit, const uint32 freq) {
+	// Bit 1 has range [0,freq) and 0 has [freq,BitTotal)
+	narrow(bit ? 0 : freq, bit ? freq : BitTotal, BitTotal);
+#ifdef DEBUG
+	std::cerr << "encode\t< " << freq << " / " 
+		<< BitTotal << " > " << "\t < " << low << " , " << high << " > "
+		<< "\t bit " << bit << std::endl;
+#endif
+	shift();
+}
+
+void encoder::encode_int(const uint64 v) {
+	// Bit length in 6 bits, then bits below the highest
+	const int n = 64 - __builtin_clzll(v);
+	for (int i = 5 ; i >= 0 ; --i)
+		encode_bit(((n - 1) >> i) & 1, BitTotal >> 1);
+	for (int i = n - 2 ; i >= 0 ; --i)
+		encode_bit((v >> i) & 1, BitTotal >> 1);
+}
+
+void encoder::narrow(const uint32 lo, const uint32 hi, const uint32 total) {
+	// Size of the current code region
+	uint64 range = (uint64) (high - low) + 1;
+	high = low + ((range * hi) / total) - 1;
+	low = low + ((range * lo) / total);
+}
 
+void encoder::shift() {
 	// Loop to output bits
 	while (true) {
 		// Output matching high bit 
@@ -133,20 +181,40 @@ void encoder::encode(const uint16 c, const uint32 * dist) {
 }
 
 void encoder::finish() {
+	terminate();
+}
+
+void encoder::sync() {
+	terminate();
+	out.flush();
+}
+
+void encoder::terminate() {
+	// Bits shifted out of code region in this segment. Decoder reads
+	// CodeValueBits ahead of these when it has decoded the last symbol.
+	uint64 shifted = ((outlen + p - segment) << 3) + bitp + bits_to_follow;
 	// Output two byte that select the quarter that the current
 	++bits_to_follow;
 	bit_plus_follow(low >= FirstQuarter);
 	// Pad output byte to to 8 byte
-	if (bitp != 0)
+	if (bitp != 0) {
 		byte <<= (8 - bitp); 
-	flush_bits();
+		bitp = 8;
+		flush_bits();
+	}
 	flush();
-	// Pad the output to CodeValueBits length
-	// FIXME Amount of fluff after end of code
-	for (int i = 0 ; i < (CodeValueBits >> 3) ; ++i) {
+	// Pad the output to exactly the length read by decoder 
+	uint64 seglen = (CodeValueBits >> 3) + ((shifted + 7) >> 3);
+	while (outlen - segment < seglen) {
 		out << (char)0;
 		++outlen;
 	}
+	segment = outlen;
+
+	// Restart code region
+	high = TopValue;
+	low = 0;
+	bits_to_follow = 0;
 }
 
 // Output byte plus following opposite bits.
@@ -169,12 +237,13 @@ void encoder::flush_bits() {
 }
 
 const uint64 encoder::len() const {
-	return outlen;
+	return outlen + p;
 }
 
 void encoder::flush() {
 	if (p == 0)
 		return;
+	profile::timer t(PhaseOutput);
 	out.write(buf, p);
 	outlen += p;
 	p = 0;
@@ -0,0 +1,299 @@
+/**
+ * Compressed frame header and trailer.
+ *
+ * Frame is magic, version and model parameters, followed by code which
+ * ends exactly after EOS and a trailer of original length and checksum.
+ * Frames can be concatenated; decompressor stops reading at frame end.
+ *
+ * Version 0 is the original format where magic is 0-terminated and
+ * checksum is read until EOF. Version 1 frames use CRC32, version 2
+ * records the checksum type, version 3 the member name in archive and
+ * version 4 the memory limit in 4 bytes instead of 2 and version 5 the
+ * deduplication window, version 6 the growing context table and
+ * version 7 orders above 7 in a byte of its own. Long-match model is
+ * a flag in the order byte, as are sync flush points.
+ *
+ * @author jkataja
+ */
+
+#pragma once
+
+#include <iostream>
+#include <string>
+#include <cstring>
+
+#include "pompom.hpp"
+#include "pompomdefs.hpp"
+
+namespace pompom {
+
+class frame {
+public:
+	// Write header
+	void write_header(std::ostream&) const;
+
+	// Read header, returns false if there is no magic
+	const bool read_header(std::istream&);
+
+	// Write trailer of original length and checksum
+	void write_trailer(std::ostream&, const uint64, const uint32) const;
+
+	// Read trailer of original length and checksum
+	const bool read_trailer(std::istream&, uint64&, uint32&) const;
+
+	// Length of header in bytes
+	const uint32 header_len() const;
+
+	// Length of trailer in bytes
+	const uint32 trailer_len() const;
+
+	// Context table grows up to memory limit (from version 6)
+	const bool growing() const;
+
+	// Format version
+	uint8 version;
+
+	// Model order
+	uint8 order;
+
+	// Stream has sync flush points
+	bool sync;
+
+	// Model has long-match model
+	bool longmatch;
+
+	// Model skips orders with low hit rate
+	bool skip;
+
+	// Model keeps 16-bit fingerprints of context keys
+	bool fingerprint;
+
+	// Model memory split to context tables (shared before version 8)
+	uint8 split;
+
+	// Coding engine (PPM before version 9)
+	uint8 engine;
+
+	// Model memory limit in MiB
+	uint32 limit;
+
+	// Model bootstrap buffer length in KiB (0 is reset)
+	uint8 bootsize;
+
+	// Model local adaptation length in bits (0 is no adaptation)
+	uint8 adaptsize;
+
+	// Original length when known when compressing
+	uint64 size;
+
+	// Checksum type
+	uint8 check;
+
+	// Member name in archive (empty for stream)
+	std::string name;
+
+	// Deduplication window in MiB (0 is no deduplication)
+	uint32 dedupsize;
+
+	frame();
+private:
+	static void write_int(std::ostream&, const uint64, const int);
+	static const uint64 read_int(std::istream&, const int);
+
+	// Length of memory limit field in bytes
+	const int limit_len() const;
+};
+
+frame::frame()
+	: version(FrameVersion), order(OrderDefault), sync(false), 
+	  longmatch(false), skip(false), fingerprint(false), split(SplitShared), engine(EnginePPM), limit(LimitDefault), bootsize(BootDefault), adaptsize(0),
+	  size(SizeUnknown), check(CheckCRC32C), dedupsize(0)
+{
+}
+
+void frame::write_int(std::ostream& out, const uint64 v, const int n) {
+	for (int i = n - 1 ; i >= 0 ; --i)
+		out << (char)((v >> (i << 3)) & 0xFF);
+}
+
+const uint64 frame::read_int(std::istream& in, const int n) {
+	uint64 v = 0;
+	for (int i = 0 ; i < n ; ++i)
+		v = ((v << 8) | (in.get() & 0xFF));
+	return v;
+}
+
+void frame::write_header(std::ostream& out) const {
+	// Magic: 3 bytes
+	out.write(Magia, sizeof(Magia) - 1);
+
+	// Format version: 1 byte
+	out << (char)version;
+
+	// Model order: 1 byte (high bits for sync flush points, match, skip
+	// and fingerprints)
+	out << (char)((order & OrderBits) | (sync ? SyncFlag : 0) 
+			| (longmatch ? MatchFlag : 0) | (skip ? SkipFlag : 0)
+			| (fingerprint ? FingerprintFlag : 0));
+
+	// Model memory limit: 2 bytes (4 bytes from version 4)
+	write_int(out, limit, limit_len());
+
+	// Model bootstrap buffer length: 1 byte
+	out << (char)bootsize;
+
+	// Model local adaptation length: 1 byte
+	out << (char)adaptsize;
+
+	// Original length: 8 bytes
+	if (version >= 1)
+		write_int(out, size, 8);
+
+	// Checksum type: 1 byte
+	if (version >= 2)
+		out << (char)check;
+
+	// Member name: 2 bytes of length and name
+	if (version >= 3) {
+		write_int(out, name.size(), 2);
+		out.write(name.data(), name.size());
+	}
+
+	// Deduplication window: 2 bytes
+	if (version >= 5)
+		write_int(out, dedupsize, 2);
+
+	// Model order: 1 byte
+	if (version >= 7)
+		out << (char)order;
+
+	// Model memory split: 1 byte
+	if (version >= 8)
+		out << (char)split;
+
+	// Coding engine: 1 byte
+	if (version >= 9)
+		out << (char)engine;
+}
+
+const bool frame::read_header(std::istream& in) {
+	// Magic: 3 bytes
+	char filemagic[ sizeof(Magia) ];
+	memset(filemagic, 0, sizeof(Magia));
+	in.read(filemagic, sizeof(Magia) - 1);
+	if (strncmp(filemagic, Magia, sizeof(Magia)) != 0)
+		return false;
+
+	// Format version: 1 byte (0-terminator of magic in version 0)
+	int v = in.get();
+	if (v < 0 || v > FrameVersion)
+		return false;
+	version = v;
+
+	// Model order: 1 byte (high bits for sync flush points, match, skip
+	// and fingerprints)
+	order = in.get();
+	if (order & ~(OrderBits | SyncFlag | MatchFlag | SkipFlag
+				| FingerprintFlag))
+		return false;
+	sync = (order & SyncFlag);
+	longmatch = (order & MatchFlag);
+	skip = (order & SkipFlag);
+	fingerprint = (order & FingerprintFlag);
+	order &= ~(SyncFlag | MatchFlag | SkipFlag | FingerprintFlag);
+
+	// Model memory limit: 2 bytes (4 bytes from version 4)
+	limit = read_int(in, limit_len());
+
+	// Model bootstrap buffer length: 1 byte
+	bootsize = in.get();
+
+	// Model local adaptation length: 1 byte
+	adaptsize = in.get();
+
+	// Original length: 8 bytes
+	size = (version >= 1 ? read_int(in, 8) : SizeUnknown);
+
+	// Checksum type: 1 byte
+	check = (version >= 2 ? in.get() : CheckCRC32);
+
+	// Member name: 2 bytes of length and name
+	name.clear();
+	if (version >= 3) {
+		uint64 n = read_int(in, 2);
+		if (n > (uint64)NameMax)
+			return false;
+		name.resize(n);
+		in.read(&name[0], n);
+	}
+
+	// Deduplication window: 2 bytes
+	dedupsize = (version >= 5 ? read_int(in, 2) : 0);
+	if (dedupsize > (uint32)DedupLimitMax)
+		return false;
+
+	// Model order: 1 byte
+	if (version >= 7)
+		order = in.get();
+
+	// Model memory split: 1 byte
+	split = (version >= 8 ? in.get() : SplitShared);
+
+	// Coding engine: 1 byte
+	engine = (version >= 9 ? in.get() : EnginePPM);
+
+	return in.good();
+}
+
+void frame::write_trailer(std::ostream& out, const uint64 len,
+		const uint32 crc) const
+{
+	// Original length: 8 bytes
+	if (version >= 1)
+		write_int(out, len, 8);
+
+	// Checksum: 4 bytes
+	write_int(out, crc, 4);
+}
+
+const bool frame::read_trailer(std::istream& in, uint64& len,
+		uint32& crc) const
+{
+	if (version >= 1) {
+		// Original length: 8 bytes
+		len = read_int(in, 8);
+		// Checksum: 4 bytes
+		crc = read_int(in, 4);
+		return in.good();
+	}
+
+	// Checksum: 4 bytes at EOF
+	len = SizeUnknown;
+	crc = 0;
+	int b;
+	while ((b = in.get()) != -1)
+		crc = ((crc << 8) | (b & 0xFF));
+	return true;
+}
+
+const uint32 frame::header_len() const {
+	return (sizeof(Magia) - 1) + 1 + 1 + limit_len() + 1 + 1 
+		+ (version >= 1 ? 8 : 0)
+		+ (version >= 2 ? 1 : 0) + (version >= 3 ? 2 + name.size() : 0)
+		+ (version >= 5 ? 2 : 0) + (version >= 7 ? 1 : 0)
+		+ (version >= 8 ? 1 : 0) + (version >= 9 ? 1 : 0);
+}
+
+const int frame::limit_len() const {
+	return (version >= 4 ? 4 : 2);
+}
+
+const bool frame::growing() const {
+	return (version >= 6);
+}
+
+const uint32 frame::trailer_len() const {
+	return (version >= 1 ? 8 : 0) + 4;
+}
+
+} // namespace
@@ -5,6 +5,8 @@
  */
 
 #include <iostream>
+#include <string>
+#include <vector>
 #include <stdexcept>
 #include <boost/program_options.hpp>
 #include <boost/format.hpp>
@@ -16,9 +18,11 @@ namespace po = boost::program_options;
 using namespace pompom;
 
 #define BUFSIZE 32768
-#define USAGE "Usage: pompom [OPTION]...\n" \
+#define USAGE "Usage: pompom [OPTION]... [FILE]...\n" \
 	"Compress or decompress input using fixed-order PPM compression.\n" \
-	"Reads from standard input and writes to standard output.\n" \
+	"Without FILE reads from standard input and writes to standard output.\n" \
+	"With FILEs compresses each FILE to FILE.pim or decompresses FILE.pim\n" \
+	"to FILE, or with archive all FILEs to or from one archive.\n" \
 	"\n"
 
 int main(int argc, char** argv) {
@@ -27,9 +31,12 @@ int main(int argc, char** argv) {
 
 	// Should improve iostream performance
 	// @see http://stackoverflow.com/questions/5166263/how-to-get-iostream-to-perform-better
+	// Buffers take effect only when not synced with stdio, and outlive
+	// main for the final flush of std::cout
 	setlocale(LC_ALL,"C");
-	char inbuf[BUFSIZE];
-	char outbuf[BUFSIZE];
+	std::ios::sync_with_stdio(false);
+	static char inbuf[BUFSIZE];
+	static char outbuf[BUFSIZE];
 	std::cin.rdbuf()->pubsetbuf(inbuf, BUFSIZE);
 	std::cout.rdbuf()->pubsetbuf(outbuf, BUFSIZE);
 
@@ -50,6 +57,10 @@ int main(int argc, char** argv) {
 			"compress: memory use in MiB [%1%,%2%]") 
 				% (int)LimitMin % (int)LimitMax));
 
+		std::string dedup_str( boost::str( boost::format(
+			"compress: deduplication window in MiB [0,%1%] (0 is off)") 
+				% (int)DedupLimitMax));
+
 		po::options_description args("Options");
 		args.add_options()
 			( "stdout,c", "compress to stdout (default)" )
@@ -77,12 +88,80 @@ int main(int argc, char** argv) {
 				po::value<int>()->default_value(LimitDefault),
 				mem_str.c_str()
 			)
+			( "match,M", "compress: long-match model for repetitive data" )
+			( "skip", "compress: skip orders where symbols are rarely found" )
+			( "fingerprint", "compress: 16-bit context keys, more contexts in memory" )
+			( "split", 
+				po::value<std::string>()->default_value("shared"),
+				"compress: context tables by length: shared|even|rising"
+			)
+			( "engine", 
+				po::value<std::string>()->default_value("ppm"),
+				"compress: coding engine: ppm|mix (binary context mixing)|"
+				"fast (order-0/1 rANS blocks)"
+			)
+			( "auto", "compress: choose order and adaptation (-o, -a) by trials "
+				"of sample; -m, -A and -b are kept as given" )
+			( "target", 
+				po::value<double>()->default_value(0),
+				"compress: auto settings of at least MB/s (0 is smallest)"
+			)
+			( "dedup", 
+				po::value<int>()->default_value(DedupDefault),
+				dedup_str.c_str()
+			)
+			( "flushbytes", 
+				po::value<long>()->default_value(FlushDefault),
+				"compress: sync flush after count bytes"
+			)
+			( "flushlines", 
+				po::value<long>()->default_value(FlushDefault),
+				"compress: sync flush after count newlines"
+			)
+			( "flushms", 
+				po::value<long>()->default_value(FlushDefault),
+				"compress: sync flush after milliseconds"
+			)
+			( "archive", 
+				po::value<std::string>(),
+				"files: compress to or decompress from archive"
+			)
+			( "jobs,j", 
+				po::value<int>()->default_value(JobsDefault),
+				"files: worker threads (0 is hardware threads)"
+			)
+			( "budget", 
+				po::value<long>()->default_value(BudgetDefault),
+				"files: memory budget in MiB of all workers (0 is no limit)"
+			)
+			( "stats", "output counters as JSON to stderr at end" )
+			( "profile", "output cycles per byte of phases to stderr at end" )
+			( "perf", "compress: output hardware counters per byte" )
+			( "trace", 
+				po::value<std::string>(),
+				"compress: write timeline of intervals to file"
+			)
+			( "tracebytes", 
+				po::value<long>()->default_value(TraceDefault),
+				"compress: input bytes between trace records"
+			)
 			;
 
+		po::options_description hidden;
+		hidden.add_options()
+			( "input", po::value< std::vector<std::string> >() )
+			;
+
+		po::options_description all;
+		all.add(args).add(hidden);
+
+		po::positional_options_description positional;
+		positional.add("input", -1);
+
 
 		po::variables_map vm;
 		po::store(po::command_line_parser(argc, argv).
-				options(args).run(), vm);
+				options(all).positional(positional).run(), vm);
 		po::notify(vm);
 
 		// help
@@ -92,18 +171,81 @@ int main(int argc, char** argv) {
 			return 1;
 		}
 
-		if (vm.count("decompress"))
-			len = decompress(std::cin, std::cout, std::cerr);
+		options opt;
+		opt.order = vm["order"].as<int>();
+		opt.limit = vm["mem"].as<int>();
+		opt.maxlen = vm["count"].as<long>();
+		opt.reset = (vm.count("reset") > 0);
+		opt.bootsize = vm["bootsize"].as<int>();
+		opt.adapt = (vm.count("adapt") > 0);
+		opt.adaptsize = vm["adaptsize"].as<int>();
+		opt.longmatch = (vm.count("match") > 0);
+		opt.skip = (vm.count("skip") > 0);
+		opt.fingerprint = (vm.count("fingerprint") > 0);
+		const std::string split = vm["split"].as<std::string>();
+		if (split == "shared")
+			opt.split = SplitShared;
+		else if (split == "even")
+			opt.split = SplitEven;
+		else if (split == "rising")
+			opt.split = SplitRising;
+		else
+			throw std::range_error("accepted split is shared, even or rising");
+		const std::string engine = vm["engine"].as<std::string>();
+		if (engine == "ppm")
+			opt.engine = EnginePPM;
+		else if (engine == "mix")
+			opt.engine = EngineMix;
+		else if (engine == "fast")
+			opt.engine = EngineFast;
+		else
+			throw std::range_error("accepted engine is ppm, mix or fast");
+		opt.autotune = (vm.count("auto") > 0);
+		opt.target = vm["target"].as<double>();
+		opt.dedupsize = vm["dedup"].as<int>();
+		opt.flushbytes = vm["flushbytes"].as<long>();
+		opt.flushlines = vm["flushlines"].as<long>();
+		opt.flushms = vm["flushms"].as<long>();
+		opt.jobs = vm["jobs"].as<int>();
+		opt.budget = vm["budget"].as<long>();
+		opt.perf = (vm.count("perf") > 0);
+		if (vm.count("trace"))
+			opt.trace = vm["trace"].as<std::string>();
+		opt.tracebytes = vm["tracebytes"].as<long>();
+
+		std::vector<std::string> files;
+		if (vm.count("input"))
+			files = vm["input"].as< std::vector<std::string> >();
+		std::string archive;
+		if (vm.count("archive"))
+			archive = vm["archive"].as<std::string>();
+
+		stats st;
+		st.profiling = (vm.count("profile") > 0);
+
+		// Many files or archive
+		if (!files.empty() || !archive.empty()) {
+			if (vm.count("decompress"))
+				len = -decompress_files(files, archive, opt, std::cerr, st);
+			else if (files.empty()) {
+				std::cerr << USAGE << args << std::endl << std::flush;
+				return 1;
+			}
+			else
+				len = -compress_files(files, archive, opt, std::cerr, st);
+		}
+		else if (vm.count("decompress"))
+			len = decompress(std::cin, std::cout, std::cerr, st);
 		else
-			len = compress(std::cin, std::cout, std::cerr, 
-				vm["order"].as<int>(), 
-				vm["mem"].as<int>(), 
-				vm["count"].as<long>(), 
-				(vm.count("reset") > 0),
-				vm["bootsize"].as<int>(),
-				(vm.count("adapt") > 0),
-				vm["adaptsize"].as<int>()
-			);
+			len = compress(std::cin, std::cout, std::cerr, opt, st);
+
+		if (vm.count("stats")) {
+			report(std::cerr, st);
+			std::cerr << std::endl;
+		}
+		if (st.profiling)
+			report_profile(std::cerr, st, 
+					(vm.count("decompress") ? "decompress" : "compress"));
 
 	}
 	catch (std::exception& e) {
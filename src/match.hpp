@@ -0,0 +1,199 @@
+/**
+ * Long-match model. Hash of the last MatchMin bytes finds the most
+ * recent earlier position of the same bytes in a history buffer, and
+ * the byte following it is predicted while the match continues. When
+ * a match is found, each byte is first coded as a binary hit or miss
+ * of the prediction with a probability adapted per match length, so
+ * long repeats cost a fraction of a bit and no PPM work.
+ *
+ * Candidates are verified against the history buffer, so a position
+ * from a stale or colliding hash entry is never predicted from.
+ *
+ * @author jkataja
+ */
+
+#pragma once
+
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+
+#include "pompom.hpp"
+#include "pompomdefs.hpp"
+
+namespace pompom {
+
+class match {
+public:
+	// Predicted next byte, or -1 when there is no match
+	inline const int predicted() const;
+
+	// Frequency of hit out of BitTotal
+	inline const uint32 hitfreq() const;
+
+	// Add byte to history and follow or find match
+	inline void update(const uint8);
+
+	// Forget history and match for a new stream
+	void clear();
+
+	// Memory use in MiB
+	match(const size_t);
+
+	// Copy of history and match state
+	match(const match *);
+
+	~match();
+private:
+	match();
+	match(const match&);
+	const match& operator=(const match&);
+
+	// Length bucket of hit probability
+	inline const int bucket() const;
+
+	// History buffer of length bufmask + 1 (power of two)
+	uint8 * buf;
+	uint64 bufmask;
+
+	// Last position of hash of MatchMin bytes, 2^tablebits entries
+	uint32 * table;
+	int tablebits;
+
+	// Count of bytes seen
+	uint64 pos;
+
+	// Rolling hash of last MatchMin bytes
+	uint32 hash;
+
+	// Position of predicted byte and length of match (0 is no match)
+	uint64 ptr;
+	uint32 len;
+
+	// Probability of hit by length bucket, 16 bits
+	uint16 prob[ MatchBuckets ];
+
+	// HashMul to the power of MatchMin, removes oldest byte from hash
+	uint32 hashout;
+
+	// Multiplier of rolling hash
+	static const uint32 HashMul = 0x2F0B3A49;
+};
+
+match::match(const size_t mem)
+	: pos(0), hash(0), ptr(0), len(0)
+{
+	// Half of memory for history, half for hash table
+	size_t half = (mem << 20) >> 1;
+	size_t buflen = 1;
+	while ((buflen << 1) <= half)
+		buflen <<= 1;
+	bufmask = buflen - 1;
+	tablebits = 0;
+	while (((size_t)1 << (tablebits + 1)) * sizeof(uint32) <= half)
+		++tablebits;
+
+	buf = (uint8 *) calloc(buflen, sizeof(uint8));
+	table = (uint32 *) calloc((size_t)1 << tablebits, sizeof(uint32));
+	if (buf == 0 || table == 0) {
+		free(buf);
+		free(table);
+		throw std::bad_alloc();
+	}
+	for (int i = 0 ; i < MatchBuckets ; ++i)
+		prob[i] = (1 << 15);
+	hashout = 1;
+	for (int i = 0 ; i < MatchMin ; ++i)
+		hashout *= HashMul;
+}
+
+match::match(const match * base)
+	: bufmask(base->bufmask), tablebits(base->tablebits), pos(base->pos),
+	  hash(base->hash), ptr(base->ptr), len(base->len),
+	  hashout(base->hashout)
+{
+	buf = (uint8 *) malloc(bufmask + 1);
+	table = (uint32 *) malloc(((size_t)1 << tablebits) * sizeof(uint32));
+	if (buf == 0 || table == 0) {
+		free(buf);
+		free(table);
+		throw std::bad_alloc();
+	}
+	memcpy(buf, base->buf, bufmask + 1);
+	memcpy(table, base->table, ((size_t)1 << tablebits) * sizeof(uint32));
+	memcpy(prob, base->prob, sizeof(prob));
+}
+
+match::~match() {
+	free(buf);
+	free(table);
+}
+
+void match::clear() {
+	memset(table, 0, ((size_t)1 << tablebits) * sizeof(uint32));
+	pos = ptr = 0;
+	hash = len = 0;
+	for (int i = 0 ; i < MatchBuckets ; ++i)
+		prob[i] = (1 << 15);
+}
+
+const int match::predicted() const {
+	return (len > 0 ? buf[ptr & bufmask] : -1);
+}
+
+const int match::bucket() const {
+	// Powers of two of length
+	int b = (31 - __builtin_clz(len));
+	return (b < MatchBuckets ? b : MatchBuckets - 1);
+}
+
+const uint32 match::hitfreq() const {
+	// Neither bit has zero frequency
+	uint32 f = (prob[ bucket() ] >> (16 - BitTotalBits));
+	return (f < 1 ? 1 : (f > BitTotal - 1 ? BitTotal - 1 : f));
+}
+
+void match::update(const uint8 c) {
+	// Follow match and adapt hit probability
+	if (len > 0) {
+		uint16& p = prob[ bucket() ];
+		if (buf[ptr & bufmask] == c) {
+			p += ((65536 - p) >> MatchRate);
+			++ptr;
+			if (len < 0xFFFFFFFF)
+				++len;
+		}
+		else {
+			p -= (p >> MatchRate);
+			len = 0;
+		}
+	}
+
+	// Roll hash over last MatchMin bytes
+	buf[pos & bufmask] = c;
+	++pos;
+	hash = (hash * HashMul) + c + 1;
+	if (pos > (uint64)MatchMin)
+		hash -= hashout * (buf[(pos - MatchMin - 1) & bufmask] + 1);
+	if (pos < (uint64)MatchMin)
+		return;
+
+	uint32& last = table[ (hash * 0x9E3779B1) >> (32 - tablebits) ];
+	if (len == 0) {
+		// Distance to candidate is in history and not before start
+		uint64 d = (uint32)((uint32)pos - last);
+		if (d > 0 && d + MatchMin <= pos && d + MatchMin <= bufmask) {
+			int i = 1;
+			for ( ; i <= MatchMin ; ++i)
+				if (buf[(pos - i) & bufmask] != buf[(pos - d - i) & bufmask])
+					break;
+			if (i > MatchMin) {
+				ptr = pos - d;
+				len = MatchMin;
+			}
+		}
+	}
+	last = (uint32)pos;
+}
+
+} // namespace
@@ -3,6 +3,35 @@
  * for escape frequency (symbols in context is the frequency of escape).
  * Update adds to symbol counts in only the contexts used in
  * compression and not in lower order contexts ("update exclusion").
+ * With the long-match model, a quarter of memory limit is given to it
+ * and bytes predicted by it are not counted in contexts.
+ *
+ * Coding starts from the highest order which has symbols in context,
+ * since escape from an empty context costs nothing. With skipping,
+ * orders where the symbol has rarely been found are passed over too.
+ * Contexts passed over are still updated.
+ *
+ * Key of context holds its length and text when it is at most 7 bytes.
+ * Longer contexts hold 48 bits of hash of the context before the last
+ * byte, and the last byte. Hash of context of order is made from hash
+ * or text of order one less, so hashes of all orders follow the text
+ * in one step each, and key of context with a following symbol is the
+ * key of the longer context as with text keys. Parent of a hashed key
+ * can't be taken from the key, so it is given to the table.
+ *
+ * Followers and their frequencies of recently coded contexts are kept
+ * in a distribution cache, and patched as the symbol is counted.
+ *
+ * Contexts of all orders share one table, or with split memory each
+ * length of context key has a table of its own, sized by the split
+ * policy up to the memory all contexts of the length could take. Only
+ * a table which fills is reset and bootstrapped, so a fill in high
+ * orders keeps the statistics of low orders.
+ *
+ * With the mixing engine, the model keeps no context tables and gives
+ * the context keys of each byte to the binary mixing engine instead.
+ * With the fast engine, it keeps no statistics at all: blocks are
+ * coded with frequencies of their own.
  *
  * @author jkataja
  */
@@ -12,18 +41,26 @@
 #include <iostream>
 #include <vector>
 #include <deque>
+#include <chrono>
 #include <boost/format.hpp>
 
 #include "pompom.hpp"
 #include "cuckoo.hpp"
+#include "match.hpp"
+#include "distcache.hpp"
+#include "bitmix.hpp"
 
 namespace pompom {
 
 class model {
 public:
 	// Returns new instance after checking model args
-	static model * instance(const int, const int, const bool, const int, const bool, const int);
+	static model * instance(const int, const int, const bool, const int, const bool, const int, const bool, const bool, const bool, const bool, const bool, const int, const int);
 	
+	// Order to start coding symbol from (-1 for none); contexts of
+	// orders above are visited for update
+	inline const int16 start();
+
 	// Give running totals of the symbols in context
 	inline void dist(const int16, uint32 *, uint64 *);
 
@@ -33,15 +70,82 @@ public:
 	// Increase symbol counts
 	inline void update(const uint16);
 
+	// Forget contexts visited by dist without increasing symbol counts
+	inline void discard();
+
+	// Forget all statistics and text context for a new stream
+	void clear();
+
+	// New model starting from the state of this model. Statistics of
+	// this model are shared read-only and only changes are stored in
+	// the new model. This model must not change while clones exist.
+	model * clone() const;
+
+	// Count of context slots changed in clone
+	const size_t changed() const;
+
+	// Counters of model and hash since clear
+	const stats counters() const;
+
+	// Fraction of context slots in use
+	const double load() const;
+
+	// Long-match model (0 is none)
+	inline match * matcher() const;
+
+	// Binary mixing engine (0 is PPM)
+	inline bitmix * mixer() const;
+
+#ifdef STATS
+	// Count symbol coded in order
+	inline void coded(const int16);
+
+	// Count escape from order
+	inline void escaped(const int16);
+
+	// Count hit or miss of long match
+	inline void matched(const bool);
+#endif
+
+	// Model has been created with the arguments
+	const bool matches(const int, const int, const bool, const int, const bool, const int, const bool, const bool, const bool, const bool, const bool, const int, const int) const;
+
 	// Prediction order
 	const uint8 order;
 
 	// Memory limit in MiB
-	const uint16 limit;
+	const uint32 limit;
+
+	// Escape in -1th order codes sync flush point
+	const bool sync;
+
+	// Bootstrap buffer length in KiB (0 is reset)
+	const uint8 bootsize;
+
+	// Local adaptation threshold in bits (0 is no adaptation)
+	const uint8 adaptsize;
+
+	// Start order skips orders with low hit rate
+	const bool skip;
+
+	// Context table grows up to memory limit
+	const bool grow;
+
+	// Context table keeps 16-bit fingerprints of keys
+	const bool fingerprint;
+
+	// Policy of splitting memory to tables by length of context
+	const uint8 split;
+
+	// Coding engine
+	const uint8 engine;
 
 	~model();
 private:
-	model(const uint8, const uint16, const uint8, const uint8);
+	model(const uint8, const uint32, const uint8, const uint8, const bool,
+			const bool, const bool, const bool, const bool,
+			const uint8, const uint8);
+	model(const model *);
 	model();
 	model(const model& old);
 	const model& operator=(const model& old);
@@ -49,14 +153,57 @@ private:
 	// Options range check
 	static void opt_check(const char *, const int, const int, const int);
 
+	// Context of order in 64b int without length: text of 7 bytes or
+	// less, or hash
+	inline const uint64 text(const int16) const;
+
+	// Context of order with following symbol before symbol is added
+	inline const uint64 follow(const int16, const uint64) const;
+
+	// Advance text contexts of all orders by symbol
+	inline void advance(const uint8);
+
+	// Start byte of mixing engine in contexts of all orders
+	void mix_start();
+
 	// Data context
 	std::deque<int> context;
 
-	// Visited nodes
-	std::vector<uint64> visit;
+	// Last 8 chars of context, most recent in low byte
+	uint64 recent;
+
+	// Hash of context of orders longer than 7 bytes
+	uint64 longtext[ OrderMax + 1 ];
+
+	// Visited nodes, at most one for each order
+	uint64 visit[ OrderMax + 1 ];
+	int visits;
 
-	// Length+Context (0-7 characters; uint64) -> Frequency (uint16)
-	cuckoo * contextfreq;
+	// Length+Context (0-7 characters or hash; uint64) -> Frequency (uint16)
+	// in one table, or in table by length of context
+	cuckoo * tables[ OrderMax + 2 ];
+	int ntables;
+
+	// Table of context
+	inline cuckoo * table(const uint64) const;
+
+	// Count symbol in context and set it as follower of parent context
+	inline const bool seen(const uint64, const uint64);
+
+	// Memory of table of each length of context in bytes
+	void split_limit(const size_t, size_t *) const;
+
+	// Long-match model (0 is none)
+	match * longmatch;
+
+	// Binary mixing engine (0 is PPM)
+	bitmix * mixing;
+
+	// Followers and frequencies of recently coded contexts
+	distcache * cache;
+
+	// Follower bit vector of context from cache or table
+	inline const uint64 * followers(const uint64);
 
 	// Call bootstrap on reset
 	bool lets_bootstrap;
@@ -70,8 +217,9 @@ private:
 	// Buffer length, used in text context and model bootstrap 
 	const uint32 history;
 
-	// Bootstrap context frequencies using recent text
-	void bootstrap();
+	// Bootstrap context frequencies of tables in bit mask using recent
+	// text
+	void bootstrap(const uint32);
 
 	// Maximum cumulative frequency met
 	bool outscale;
@@ -84,6 +232,21 @@ private:
 
 	// Sum of escaped cumulative frequency
 	uint64 sum_esc;
+
+	// Probability that symbol is in context of order, 16 bits
+	uint16 hitprob[ OrderMax + 1 ];
+
+	// Orders with symbols in context for current symbol
+	uint32 probed;
+
+	// Counters of model
+	stats counts;
+
+	// Longest context in bytes kept as text in key
+	static const int KeyText = 7;
+
+	// Multiplier of hash of longer context
+	static const uint64 KeyHashMul = 0x9E3779B97F4A7C15ULL;
 };
 
 void model::dist(const int16 ord, uint32 * dist, uint64 * x_mask) {
@@ -107,6 +270,9 @@ void model::dist(const int16 ord, uint32 * dist, uint64 * x_mask) {
 				++p;
 			}
 		}
+		// Escape has frequency only when sync flush points are used
+		if (sync)
+			++run;
 		dist[ L(EOS) ] = run;
 		dist[ R(EOS) ] = ++run;
 		return;
@@ -123,37 +289,53 @@ void model::dist(const int16 ord, uint32 * dist, uint64 * x_mask) {
 	}
 
 	// Existing context in 64b int
-	uint64 parent = 0;
-	for (int i = ord - 1 ; i >= 0 ; --i) 
-		parent |= (0xFFULL & context[i]) << (i << 3); // context chars
+	uint64 parent = text(ord);
 
 	// First bit always set
 	// Length (+1 for following): 2 bytes
 	// Context char: 6 bytes
 	// Following char: 1 byte
-	uint64 keybase = ((0x81ULL + ord) << 56) | (parent << 8); 
+	uint64 keybase = ((0x81ULL + ord) << 56) | follow(ord, parent); 
 
 	// Length of context
 	parent |= ((0x80ULL + ord) << 56); 
 
 	// Following letters in parent context
-	const uint64 * follow_vec = contextfreq->get_follower_vec(parent);
+	distcache::entry * e = cache->find(parent);
+	const uint64 * follow_vec = (e ? e->vec 
+			: table(parent)->get_follower_vec(parent));
 
 	// No symbols in context, assign 1/1 to escape
 	if (follow_vec[0] == 0 && follow_vec[1] == 0 
 			&& follow_vec[2] == 0 && follow_vec[3] == 0) {
 		memset(dist, 0, sizeof(int) * (R(EOS) + 1));
 		dist[ R(EOS) ] = dist[ R(Escape) ] = 1;
-		visit.push_back(keybase);
+		visit[ visits++ ] = keybase;
 		return;
 	}
 
+	probed |= (1 << ord);
+
+	// Frequencies of all followers into cache
+	STAT( if (e) ++counts.cached[ord]; else ++counts.uncached[ord]; )
+	if (e == 0) {
+		e = cache->put(parent);
+		memcpy(e->vec, follow_vec, sizeof(e->vec));
+		for (int w = 0 ; w < ((Alpha + 1) >> 6) ; ++w) {
+			for (uint64 bits = e->vec[w] ; bits != 0 ; 
+					bits &= (bits - 1)) {
+				int c = ((w << 6) | (63 - __builtin_ctzll(bits)));
+				e->freq[c] = table(keybase)->count(keybase | c);
+			}
+		}
+	}
+
 	// Add counts for successor chars from context
 	for (int c = 0 ; c <= Alpha ; ++c) {
 		// Only add if symbol had 0 frequency in higher order
-		if (((x_mask[p] & follow_vec[p]) & c_mask) > 0) {
+		if (((x_mask[p] & e->vec[p]) & c_mask) > 0) {
 			// Frequency of following context
-			int freq = contextfreq->count(keybase | c);
+			int freq = e->freq[c];
 			// freq may be zero after shift-right at rescale()
 			if (freq > 0) {
 				// Update cumulative frequency
@@ -179,12 +361,70 @@ void model::dist(const int16 ord, uint32 * dist, uint64 * x_mask) {
 	dist[ R(EOS) ] = dist[ R(Escape) ] = run + (syms > 0 ? syms : 1); 
 
 	// Rescale forced by on encoder numerical limit
-	outscale = (outscale || (dist[ R(Escape) ] > CoderRescale));
+	if (!outscale && dist[ R(Escape) ] > CoderRescale) {
+		STAT( ++counts.rescales_coder; )
+		outscale = true;
+	}
 
 	last_run += run;
 	lastest_run = run;
 
-	visit.push_back(keybase);
+	visit[ visits++ ] = keybase;
+}
+
+const int16 model::start() {
+	for (int ord = order ; ord >= 0 ; --ord) {
+		// Just escapes before we have any context
+		if ((int)context.size() < ord)
+			continue;
+
+		uint64 parent = text(ord);
+		const uint64 * follow_vec = followers(
+				parent | ((0x80ULL + ord) << 56));
+		if (follow_vec[0] != 0 || follow_vec[1] != 0 
+				|| follow_vec[2] != 0 || follow_vec[3] != 0) {
+			// Symbol is likely found in context
+			if (!skip || hitprob[ord] >= SkipThreshold)
+				return ord;
+			probed |= (1 << ord);
+		}
+
+		// Escape costs nothing, or is not coded
+		STAT( ++counts.skips; )
+		visit[ visits++ ] = ((0x81ULL + ord) << 56) | follow(ord, parent);
+	}
+	return -1;
+}
+
+const uint64 * model::followers(const uint64 key) {
+	distcache::entry * e = cache->find(key);
+	return (e ? e->vec : table(key)->get_follower_vec(key));
+}
+
+cuckoo * model::table(const uint64 key) const {
+	return tables[ ntables == 1 ? 0 : (int)(key >> 56) - 0x80 ];
+}
+
+const bool model::seen(const uint64 key, const uint64 parent) {
+	if (!table(key)->seen(key))
+		return false;
+
+	// Set bit for this node in parent context bit vector
+	table(parent)->set_follower(parent, (key & 0xFF));
+	return true;
+}
+
+const uint64 model::text(const int16 ord) const {
+	if (ord > KeyText)
+		return longtext[ord];
+	return (recent & ((1ULL << (ord << 3)) - 1)); // context chars
+}
+
+const uint64 model::follow(const int16 ord, const uint64 t) const {
+	if (ord < KeyText)
+		return (t << 8);
+	// High 48 bits of product depend on all bytes of text or hash
+	return (((t * KeyHashMul) >> 16) << 8);
 }
 
 void model::opt_check(const char * desc, const int val, 
@@ -200,7 +440,9 @@ void model::opt_check(const char * desc, const int val,
 
 model * model::instance(const int ord, const int lim, 
 		const bool reset, const int bootsize,
-		const bool adapt, const int adaptsize) 
+		const bool adapt, const int adaptsize, const bool sync,
+		const bool longmatch, const bool skip, const bool grow,
+		const bool fingerprint, const int split, const int engine) 
 {
 	opt_check("order", ord, OrderMin, OrderMax);
 	opt_check("limit", lim, LimitMin, LimitMax);
@@ -208,36 +450,217 @@ model * model::instance(const int ord, const int lim,
 		opt_check("bootstrap buffer", bootsize, BootMin, BootMax);
 	if (adapt)
 		opt_check("adapt", adaptsize, AdaptMin, AdaptMax);
+	opt_check("split", split, SplitShared, SplitMax);
+	opt_check("engine", engine, EnginePPM, EngineMax);
 	return new model(ord, lim, (reset ? 0 : bootsize), 
-			(adapt ? adaptsize : 0));
+			(adapt ? adaptsize : 0), sync, longmatch, skip, grow,
+			fingerprint, split, engine);
 }
 
-model::model(const uint8 ord, const uint16 lim, const uint8 bootsize, 
-		const uint8 adaptsize) 
+model::model(const uint8 ord, const uint32 lim, const uint8 boot, 
+		const uint8 adapt, const bool sync_points, const bool long_match,
+		const bool skipping, const bool growing,
+		const bool fingerprint_keys, const uint8 split_policy,
+		const uint8 coding_engine) 
 	: order(ord), 
 	  limit(lim), 
-	  contextfreq(0), 
-	  lets_bootstrap(bootsize > 0),
-	  lets_esc_rescale(adaptsize > 0), 
-	  adaptcount((1 << adaptsize) - 1), 
-	  history(lets_bootstrap ? (bootsize << 10) : ord), 
+	  sync(sync_points), 
+	  bootsize(boot), 
+	  adaptsize(adapt), 
+	  skip(skipping), 
+	  grow(growing), 
+	  fingerprint(fingerprint_keys), 
+	  split(split_policy), 
+	  engine(coding_engine), 
+	  recent(0), 
+	  visits(0), 
+	  ntables(coding_engine != EnginePPM ? 0 
+			  : (split_policy == SplitShared ? 1 : ord + 2)), 
+	  longmatch(0), 
+	  mixing(0), 
+	  cache(0), 
+	  lets_bootstrap(boot > 0),
+	  lets_esc_rescale(adapt > 0), 
+	  adaptcount((1 << adapt) - 1), 
+	  history(lets_bootstrap ? (boot << 10) : ord), 
 	  outscale(false), 
 	  last_run(0), 
 	  lastest_run(0), 
-	  sum_esc(0)
+	  sum_esc(0),
+	  probed(0)
 {
 #ifdef VERBOSE
 	std::cerr << "model order:" << (int)order << " limit:" << (int)limit 
 		<< " bootstrap:" << lets_bootstrap << " bootsize:" << (int)bootsize
 		<< " adapt:" << lets_esc_rescale << " adaptsize:" << (int)adaptsize 
-		<< std::endl;
+		<< " sync:" << sync << " match:" << long_match << std::endl;
 #endif
-	visit.reserve(order);
-	contextfreq = new cuckoo(lim);
+	for (int i = 0 ; i <= OrderMax ; ++i)
+		hitprob[i] = (1 << 15);
+	memset(longtext, 0, sizeof(longtext));
+	memset(tables, 0, sizeof(tables));
+	size_t mem = ((size_t)(long_match ? lim - (lim >> 2) : lim) << 20);
+	size_t budget[ OrderMax + 2 ];
+	split_limit(mem, budget);
+	try {
+		for (int i = 0 ; i < ntables ; ++i)
+			tables[i] = new cuckoo(budget[i], grow, fingerprint);
+		if (long_match)
+			longmatch = new match(lim >> 2);
+		if (engine == EngineMix)
+			mixing = new bitmix(order, mem, longmatch);
+		cache = new distcache(DistCacheBits);
+	}
+	catch (...) {
+		for (int i = 0 ; i < ntables ; ++i)
+			delete tables[i];
+		delete longmatch;
+		delete mixing;
+		throw;
+	}
+	if (mixing)
+		mix_start();
+}
+
+model::model(const model * base)
+	: order(base->order), 
+	  limit(base->limit), 
+	  sync(base->sync), 
+	  bootsize(base->bootsize), 
+	  adaptsize(base->adaptsize), 
+	  skip(base->skip), 
+	  grow(base->grow), 
+	  fingerprint(base->fingerprint), 
+	  split(base->split), 
+	  engine(base->engine), 
+	  context(base->context),
+	  recent(base->recent),
+	  visits(base->visits),
+	  ntables(base->ntables), 
+	  longmatch(0), 
+	  mixing(0), 
+	  cache(0), 
+	  lets_bootstrap(base->lets_bootstrap),
+	  lets_esc_rescale(base->lets_esc_rescale), 
+	  adaptcount(base->adaptcount), 
+	  history(base->history), 
+	  outscale(base->outscale), 
+	  last_run(base->last_run), 
+	  lastest_run(base->lastest_run), 
+	  sum_esc(base->sum_esc),
+	  probed(base->probed)
+{
+	memcpy(visit, base->visit, sizeof(visit));
+	memcpy(hitprob, base->hitprob, sizeof(hitprob));
+	memcpy(longtext, base->longtext, sizeof(longtext));
+	memset(tables, 0, sizeof(tables));
+	for (int i = 0 ; i < ntables ; ++i)
+		tables[i] = new cuckoo(base->tables[i]);
+	if (base->longmatch)
+		longmatch = new match(base->longmatch);
+	if (base->mixing)
+		mixing = new bitmix(base->mixing, longmatch);
+	cache = new distcache(DistCacheBits);
 }
 
 model::~model() {
-	delete contextfreq;
+	for (int i = 0 ; i < ntables ; ++i)
+		delete tables[i];
+	delete longmatch;
+	delete mixing;
+	delete cache;
+}
+
+model * model::clone() const {
+	return new model(this);
+}
+
+const size_t model::changed() const {
+	size_t n = 0;
+	for (int i = 0 ; i < ntables ; ++i)
+		n += tables[i]->changed();
+	return n;
+}
+
+void model::split_limit(const size_t mem, size_t * budget) const {
+	if (ntables == 1) {
+		budget[0] = mem;
+		return;
+	}
+
+	// Share of memory left by weight, unless all contexts of the
+	// length take less; those are given what they take first
+	uint32 weight[ OrderMax + 2 ];
+	bool given[ OrderMax + 2 ];
+	for (int k = 0 ; k < ntables ; ++k) {
+		weight[k] = (split == SplitRising ? k + 1 : 1);
+		given[k] = false;
+	}
+	size_t left = mem;
+	for (bool capped = true ; capped ; ) {
+		capped = false;
+		uint64 total = 0;
+		for (int k = 0 ; k < ntables ; ++k)
+			if (!given[k])
+				total += weight[k];
+		for (int k = 0 ; k < ntables && !capped ; ++k) {
+			if (given[k] || k > SplitCapOrder)
+				continue;
+			size_t all = std::max((size_t)SplitContextBytes << (k << 3), 
+					(size_t)SplitTableMin);
+			if (all <= left / total * weight[k]) {
+				budget[k] = all;
+				left -= all;
+				given[k] = capped = true;
+			}
+		}
+		if (!capped) {
+			for (int k = 0 ; k < ntables ; ++k)
+				if (!given[k])
+					budget[k] = std::max(left / total * weight[k], 
+							(size_t)SplitTableMin);
+		}
+	}
+}
+
+const bool model::matches(const int ord, const int lim, 
+		const bool reset, const int boot,
+		const bool adapt, const int adapt_bits, const bool sync_points,
+		const bool long_match, const bool skipping, const bool growing,
+		const bool fingerprint_keys, const int split_policy,
+		const int coding_engine) const
+{
+	return (ord == order && (uint32)lim == limit && sync_points == sync
+		&& long_match == (longmatch != 0) && skipping == skip && growing == grow
+		&& fingerprint_keys == fingerprint
+		&& split_policy == split && coding_engine == engine
+		&& (reset ? 0 : boot) == bootsize 
+		&& (adapt ? adapt_bits : 0) == adaptsize);
+}
+
+void model::clear() {
+	context.clear();
+	recent = 0;
+	memset(longtext, 0, sizeof(longtext));
+	visits = 0;
+	for (int i = 0 ; i < ntables ; ++i)
+		tables[i]->clear();
+	cache->clear();
+	if (longmatch)
+		longmatch->clear();
+	if (mixing) {
+		mixing->clear();
+		mix_start();
+	}
+	lets_bootstrap = (bootsize > 0);
+	outscale = false;
+	last_run = lastest_run = sum_esc = 0;
+	probed = 0;
+	for (int i = 0 ; i <= OrderMax ; ++i)
+		hitprob[i] = (1 << 15);
+	counts = stats();
+	for (int i = 0 ; i < ntables ; ++i)
+		tables[i]->counts = stats();
 }
 
 void model::update(const uint16 c) { 
@@ -247,10 +670,17 @@ void model::update(const uint16 c) {
 	}
 #endif
 
+	// Mixing engine learns bits as they are coded
+	if (mixing) {
+		advance(c);
+		return;
+	}
+
 	// Rescale when past escaped frequency count threshold
 	if (lets_esc_rescale) {
 		sum_esc += (last_run - lastest_run);
 		if (!outscale && (sum_esc >= adaptcount)) { 
+			STAT( ++counts.rescales_adapt; )
 #ifdef VERBOSE
 			std::cerr << "escape frequency rescale sum_esc:" << sum_esc 
 				<< " adaptcount:" << adaptcount << std::endl;
@@ -261,10 +691,28 @@ void model::update(const uint16 c) {
 		last_run = lastest_run = 0;
 	}
 
+	// Hit rates of orders which had symbols in context
+	if (skip) {
+		for (int i = 0 ; i < visits ; ++i) {
+			int ord = (int)(visit[i] >> 56) - 0x81;
+			if ((probed & (1 << ord)) == 0)
+				continue;
+			uint16& p = hitprob[ord];
+			if (table(visit[i])->count(visit[i] | c) > 0)
+				p += ((65536 - p) >> SkipRate);
+			else
+				p -= (p >> SkipRate);
+		}
+	}
+	probed = 0;
+
 	// Check if maximum frequency would be met
-	for (auto it = visit.begin() ; it != visit.end() ; it++ ) {
-		uint64 key = ((*it) | c);
-		outscale = (outscale || contextfreq->count(key) >= MaxFrequency);
+	for (int i = 0 ; i < visits ; ++i) {
+		uint64 key = (visit[i] | c);
+		if (!outscale && table(key)->count(key) >= MaxFrequency) {
+			STAT( ++counts.rescales_maxfreq; )
+			outscale = true;
+		}
 	}
 	// Rescale before updates
 	if (outscale) {
@@ -275,31 +723,78 @@ void model::update(const uint16 c) {
 
 	// Update frequency of c from visited nodes
 	// Don't update lower order contexts ("update exclusion")
-	for (auto it = visit.begin() ; it != visit.end() ; it++ ) {
-		uint64 key = ((*it) | c);
-		contextfreq->seen(key);
+	for (int i = 0 ; i < visits ; ++i) {
+		int ord = (int)(visit[i] >> 56) - 0x81;
+		uint64 key = (visit[i] | c);
+		uint64 parent = ((0x80ULL + ord) << 56) | text(ord);
+		seen(key, parent);
+
+		// Patch cached context
+		distcache::entry * e = cache->find(parent);
+		if (e) {
+			e->vec[c >> 6] |= (1ULL << (63 - (c & 63)));
+			e->freq[c] = table(key)->count(key);
+		}
 	}
-	visit.clear();
+	visits = 0;
 
 	// Instead of rehashing, clear context data when preset size is full
-	if (contextfreq->full()) {
+	uint32 filled = 0;
+	for (int i = 0 ; i < ntables ; ++i) {
+		if (!tables[i]->full())
+			continue;
+		tables[i]->reset();
+		++counts.resets;
+		filled |= (1 << i);
+	}
+	if (filled) {
 		sum_esc = 0;
 
-		contextfreq->reset();
-
 		// Bootstrap based on most recent text
-		if (lets_bootstrap && context.size() == history)
-			bootstrap();
+		if (lets_bootstrap && context.size() == history) {
+			STAT( auto start = std::chrono::steady_clock::now(); )
+			bootstrap(filled);
+			++counts.bootstraps;
+			STAT( counts.bootstrap_seconds += std::chrono::duration<double>(
+					std::chrono::steady_clock::now() - start).count(); )
+		}
+		cache->clear();
 	}
 
-	// Update text context
+	// Update text context, longest first from context one shorter
 	if (context.size() == history)
 		context.pop_back();
 	context.push_front(c);
+	advance(c);
+}
+
+void model::advance(const uint8 c) {
+	for (int ord = order ; ord > KeyText ; --ord)
+		longtext[ord] = (follow(ord - 1, text(ord - 1)) | c);
+	recent = ((recent << 8) | c);
+
+	if (longmatch)
+		longmatch->update(c);
+
+	if (mixing)
+		mix_start();
+}
 
+void model::mix_start() {
+	uint64 keys[ OrderMax + 1 ];
+	for (int ord = 0 ; ord <= order ; ++ord)
+		keys[ord] = (text(ord) | ((0x80ULL + ord) << 56));
+	mixing->start(keys);
 }
 
-void model::bootstrap() {
+void model::discard() {
+	visits = 0;
+	probed = 0;
+	last_run = lastest_run = 0;
+}
+
+void model::bootstrap(const uint32 fill) {
+	profile::timer t(PhaseBootstrap);
 #ifdef VERBOSE
 	std::cerr << "bootstrap" << std::endl;
 #endif
@@ -308,34 +803,42 @@ void model::bootstrap() {
 	assert (context.size() == history);
 #endif
 
-	// Circular buffer
-	uint64 tailtext = 0;
-	for (int i = order ; i >= 0 ; --i) {
-		uint8 c = context[i];
-		tailtext = ((tailtext << 8) | c);
-	}
-	
-	// Key mask for characters (max 7 bytes)
-	uint64 mask = 0xFF;
-	for (int ord = 0 ; ord <= order ; ++ord) {
+	// Circular buffer: tail of most recent text, then history buffer
+	const int tail = order + 1;
+	std::vector<uint8> buf(tail + history);
+	for (int i = order ; i >= 0 ; --i)
+		buf[order - i] = context[i];
+	for (int i = history - 1 ; i >= 0 ; --i)
+		buf[tail + history - 1 - i] = context[i];
+
+	// Context of order ending at each position, made from context of
+	// order one less ending at position before
+	std::vector<uint64> texts(buf.size(), 0);
 
-		uint64 text = tailtext;
+	for (int ord = 0 ; ord <= order ; ++ord) {
 		
 		// Key length marker
 		uint64 len = ((0x81ULL + ord) << 56);
-
-		// History buffer
-		for (int i = history - 1 ; i >= 0 ; --i) {
-			uint8 c = context[i];
-			text = ((text << 8) | c);
+		uint64 parentlen = ((0x80ULL + ord) << 56);
+
+		// Contexts of lower orders are made for higher orders
+		const bool filling = (fill & (1 << (ntables == 1 ? 0 : ord + 1)));
+
+		uint64 prev = 0;
+		for (size_t i = 0 ; i < buf.size() ; ++i) {
+			uint64 parent = prev;
+			prev = texts[i];
+			texts[i] = (follow(ord, parent) | buf[i]);
+			if (i < (size_t)tail || !filling)
+				continue;
 	
 			// Mark context as visited
 			// Insertion fails if history if too large to fit in memory
 			// Disable bootstrap
 			// TODO ex. cut history size in half, until minimal cap
-			uint64 key = (len | (mask & text));
-			if (!contextfreq->seen(key)) {
-				contextfreq->reset();
+			uint64 key = (len | texts[i]);
+			if (!seen(key, parentlen | parent)) {
+				table(key)->reset();
 				lets_bootstrap = false;
 #ifdef VERBOSE
 				std::cerr << "history is too large to fit in memory, bootstrap disabled" << std::endl;
@@ -343,15 +846,56 @@ void model::bootstrap() {
 				return;
 			}
 		}
-
-		mask = ((mask << 8) | 0xFF);
 	}
 
 }
 
 void model::rescale() {
 	// Rescale all entries
-	contextfreq->rescale();
+	for (int i = 0 ; i < ntables ; ++i)
+		tables[i]->rescale();
+	cache->clear();
+	++counts.rescales;
+}
+
+#ifdef STATS
+void model::coded(const int16 ord) {
+	++counts.coded[ ord + 1 ];
+}
+
+void model::escaped(const int16 ord) {
+	++counts.escapes[ ord + 1 ];
+}
+
+void model::matched(const bool hit) {
+	if (hit)
+		++counts.match_hits;
+	else
+		++counts.match_misses;
+}
+#endif
+
+const double model::load() const {
+	// Fullest table
+	double l = 0;
+	for (int i = 0 ; i < ntables ; ++i)
+		l = std::max(l, tables[i]->load());
+	return l;
+}
+
+match * model::matcher() const {
+	return longmatch;
+}
+
+bitmix * model::mixer() const {
+	return mixing;
+}
+
+const stats model::counters() const {
+	stats s = counts;
+	for (int i = 0 ; i < ntables ; ++i)
+		s.add(tables[i]->counts);
+	return s;
 }
 
 } // namespace
@@ -0,0 +1,118 @@
+/**
+ * Open addressing hash map from table index to entry. Records changes
+ * to a read-only base table, so a copy of the table costs only as much
+ * as the entries changed in it. Grows by doubling at half load.
+ *
+ * @author jkataja
+ */
+
+#pragma once
+
+#include <vector>
+
+#include "pompomdefs.hpp"
+
+namespace pompom {
+
+template <class T>
+class overlay {
+public:
+	// Changed entry at index, or 0 when entry is as in base
+	inline const T * find(const uint64) const;
+
+	// Entry at index for changing; initialized from base on first change
+	inline T& get(const uint64, const T&);
+
+	// Count of changed entries
+	const size_t size() const;
+
+	// Changed indexes and entries
+	template <class F> void each(F) const;
+
+	overlay();
+private:
+	overlay(const overlay&);
+	const overlay& operator=(const overlay&);
+
+	// Index+1 of entry (0 is empty)
+	std::vector<uint64> idx;
+	std::vector<T> val;
+
+	size_t n;
+	uint64 mask;
+
+	inline const uint64 pos(const uint64) const;
+	void grow();
+
+	static const uint64 InitialLen = 256;
+};
+
+template <class T>
+overlay<T>::overlay()
+	: idx(InitialLen, 0), val(InitialLen), n(0), mask(InitialLen - 1)
+{
+}
+
+template <class T>
+const uint64 overlay<T>::pos(const uint64 i) const {
+	// Fibonacci hashing
+	return (((i + 1) * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+}
+
+template <class T>
+const T * overlay<T>::find(const uint64 i) const {
+	for (uint64 p = pos(i) ; idx[p] != 0 ; p = (p + 1) & mask)
+		if (idx[p] == i + 1)
+			return &val[p];
+	return 0;
+}
+
+template <class T>
+T& overlay<T>::get(const uint64 i, const T& base) {
+	uint64 p = pos(i);
+	for ( ; idx[p] != 0 ; p = (p + 1) & mask)
+		if (idx[p] == i + 1)
+			return val[p];
+
+	if (((n + 1) << 1) > idx.size()) {
+		grow();
+		return get(i, base);
+	}
+	idx[p] = i + 1;
+	val[p] = base;
+	++n;
+	return val[p];
+}
+
+template <class T>
+void overlay<T>::grow() {
+	std::vector<uint64> old_idx(idx.size() << 1, 0);
+	std::vector<T> old_val(val.size() << 1);
+	old_idx.swap(idx);
+	old_val.swap(val);
+	mask = idx.size() - 1;
+	for (size_t q = 0 ; q < old_idx.size() ; ++q) {
+		if (old_idx[q] == 0)
+			continue;
+		uint64 p = pos(old_idx[q] - 1);
+		while (idx[p] != 0)
+			p = (p + 1) & mask;
+		idx[p] = old_idx[q];
+		val[p] = old_val[q];
+	}
+}
+
+template <class T>
+const size_t overlay<T>::size() const {
+	return n;
+}
+
+template <class T>
+template <class F>
+void overlay<T>::each(F f) const {
+	for (size_t p = 0 ; p < idx.size() ; ++p)
+		if (idx[p] != 0)
+			f(idx[p] - 1, val[p]);
+}
+
+} // namespace
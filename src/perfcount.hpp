@@ -0,0 +1,159 @@
+/**
+ * Hardware performance counters of the calling thread with Linux
+ * perf_event_open: cycles, instructions, last level cache misses,
+ * data TLB misses and branch misses. Counters which can't be opened
+ * (no PMU, paranoid setting, other systems) are left out.
+ *
+ * @see man perf_event_open
+ * @author jkataja
+ */
+
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "pompomdefs.hpp"
+
+namespace pompom {
+
+class perfcount {
+public:
+	// Start counting
+	void start();
+
+	// Stop counting
+	void stop();
+
+	// Some counter is available
+	const bool available() const;
+
+	// Counts per byte of length, or note that counters are missing
+	void report(std::ostream&, const uint64) const;
+
+	perfcount();
+	~perfcount();
+private:
+	perfcount(const perfcount&);
+	const perfcount& operator=(const perfcount&);
+
+	static const int Events = 5;
+
+	// File descriptor of counter (-1 is not available)
+	int fd[ Events ];
+
+	// Count, scaled when counter was multiplexed
+	double value[ Events ];
+
+	static const char * name(const int);
+};
+
+perfcount::perfcount() {
+	for (int i = 0 ; i < Events ; ++i) {
+		fd[i] = -1;
+		value[i] = 0;
+	}
+#ifdef __linux__
+	static const uint32 Types[ Events ] = {
+		PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+		PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE };
+	static const uint64 Configs[ Events ] = {
+		PERF_COUNT_HW_CPU_CYCLES,
+		PERF_COUNT_HW_INSTRUCTIONS,
+		PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+			| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+			| (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+		PERF_COUNT_HW_BRANCH_MISSES };
+	for (int i = 0 ; i < Events ; ++i) {
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = Types[i];
+		attr.config = Configs[i];
+		attr.disabled = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+			| PERF_FORMAT_TOTAL_TIME_RUNNING;
+		// This thread on any cpu
+		fd[i] = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+	}
+#endif
+}
+
+perfcount::~perfcount() {
+#ifdef __linux__
+	for (int i = 0 ; i < Events ; ++i)
+		if (fd[i] >= 0)
+			close(fd[i]);
+#endif
+}
+
+const char * perfcount::name(const int i) {
+	static const char * Names[ Events ] = { "cycles", "instructions",
+		"llc-misses", "dtlb-misses", "branch-misses" };
+	return Names[i];
+}
+
+void perfcount::start() {
+#ifdef __linux__
+	for (int i = 0 ; i < Events ; ++i) {
+		if (fd[i] < 0)
+			continue;
+		ioctl(fd[i], PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd[i], PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+}
+
+void perfcount::stop() {
+#ifdef __linux__
+	for (int i = 0 ; i < Events ; ++i) {
+		if (fd[i] < 0)
+			continue;
+		ioctl(fd[i], PERF_EVENT_IOC_DISABLE, 0);
+		// Count, time enabled and time running
+		uint64 v[3];
+		if (read(fd[i], v, sizeof(v)) != sizeof(v) || v[2] == 0) {
+			close(fd[i]);
+			fd[i] = -1;
+			continue;
+		}
+		// Scale count of multiplexed counter
+		value[i] = (double)v[0] * v[1] / v[2];
+	}
+#endif
+}
+
+const bool perfcount::available() const {
+	for (int i = 0 ; i < Events ; ++i)
+		if (fd[i] >= 0)
+			return true;
+	return false;
+}
+
+void perfcount::report(std::ostream& out, const uint64 len) const {
+	if (!available()) {
+		out << "performance counters not available";
+		return;
+	}
+	const double n = (len > 0 ? (double)len : 1.0);
+	out << "per byte";
+	for (int i = 0 ; i < Events ; ++i) {
+		if (fd[i] < 0)
+			continue;
+		out << " " << name(i) << " " << std::fixed
+			<< std::setprecision(3) << (value[i] / n);
+	}
+}
+
+} // namespace
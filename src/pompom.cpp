@@ -1,59 +1,271 @@
 #include <iomanip>
+#include <sstream>
+#include <fstream>
 #include <cstring>
+#include <chrono>
+#include <ctime>
+#include <atomic>
+#include <algorithm>
+#include <sys/stat.h>
+#include <poll.h>
+#include <cerrno>
+#include <unistd.h>
 #include <boost/format.hpp>
-#include <boost/crc.hpp>
 
 #include "pompom.hpp"
 #include "model.hpp"
 #include "decoder.hpp"
+#include "blockdecoder.hpp"
 #include "encoder.hpp"
+#include "compressor.hpp"
+#include "dedup.hpp"
+#include "checksum.hpp"
+#include "frame.hpp"
+#include "scheduler.hpp"
+#include "workspace.hpp"
+#include "profile.hpp"
+#include "perfcount.hpp"
+#include "trace.hpp"
 
 namespace pompom {
 
-long decompress(std::istream& in, std::ostream& out, std::ostream& err) {
+// Output to stream, flushed at sync flush points
+class stream_sink {
+public:
+	stream_sink(std::ostream& proxy) : out(proxy) {}
+	void reserve(const uint64) {}
+	void write(const char * buf, const size_t n) { out.write(buf, n); }
+	void flush() { out.flush(); }
+private:
+	std::ostream& out;
+};
 
-	// Magic header: 0-terminated std::string
-	char filemagic[ sizeof(Magia) ];
-	in.getline(filemagic, sizeof(Magia), (char)0);
-	if (strncmp(filemagic, Magia, sizeof(Magia)) != 0) {
-		err << SELF << ": no magic" << std::endl << std::flush;
-		return -1;
+// Output appended to string, preallocated for original length
+class string_sink {
+public:
+	string_sink(std::string& proxy) : out(proxy) {}
+	void reserve(const uint64 n) { out.reserve(out.size() + n); }
+	void write(const char * buf, const size_t n) { out.append(buf, n); }
+	void flush() {}
+private:
+	std::string& out;
+};
+
+// Read-only stream buffer over array
+class array_buf : public std::streambuf {
+public:
+	array_buf(const char * p, const size_t n) {
+		char * b = const_cast<char *>(p);
+		setg(b, b, b + n);
 	}
+};
 
-	// Model order: 1 byte
-	uint8 order = in.get();
+// Stream buffer appending to string
+class string_buf : public std::streambuf {
+public:
+	string_buf(std::string& proxy) : out(proxy) {}
+protected:
+	int_type overflow(int_type c) {
+		if (c != traits_type::eof())
+			out.push_back(traits_type::to_char_type(c));
+		return c;
+	}
+	std::streamsize xsputn(const char * p, std::streamsize n) {
+		out.append(p, n);
+		return n;
+	}
+private:
+	std::string& out;
+};
 
-	// Model memory limit: 2 bytes
-	uint16 limit = ((in.get() << 8) | in.get());
+// Input stream buffer reading prefix before rest of stream
+class prefix_buf : public std::streambuf {
+public:
+	prefix_buf(std::string& prefix, std::streambuf * proxy) : rest(proxy) {
+		setg(&prefix[0], &prefix[0], &prefix[0] + prefix.size());
+	}
+protected:
+	int_type underflow() {
+		// Only bytes available, so a stalled stream is seen by poll
+		const std::streamsize want = std::max<std::streamsize>(1, 
+				std::min<std::streamsize>(rest->in_avail(), BlockSize));
+		std::streamsize n = rest->sgetn(buf, want);
+		if (n <= 0)
+			return traits_type::eof();
+		setg(buf, buf, buf + n);
+		return traits_type::to_int_type(buf[0]);
+	}
+	std::streamsize showmanyc() {
+		return rest->in_avail();
+	}
+private:
+	std::streambuf * rest;
+	char buf[ BlockSize ];
+};
 
-	// Model bootstrap buffer length: 1 byte
-	uint8 bootsize = in.get();
+// Decode blocks of fast engine until EOS, returns length or -1 on
+// unexpected end; each block is output as it is decoded
+template <class Sink>
+static long decode_blocks(std::istream& in, Sink& out, checksum& sum) {
+	blockdecoder dec(in);
+	uint64 len = 0;
+	long n;
+	while ((n = dec.next()) > 0) {
+		{
+			profile::timer check(PhaseChecksum);
+			sum.update(dec.data(), n);
+		}
+		profile::timer output(PhaseOutput);
+		out.write(dec.data(), n);
+		out.flush();
+		len += n;
+	}
+	return (n < 0 ? -1 : (long)len);
+}
 
-	// Model local adaptation length: 1 byte
-	uint8 adaptsize = in.get();
+// Decode symbols until EOS, returns length or -1 on unexpected end;
+// references are copied from window of dedup stage when given
+template <class Sink>
+static long decode(std::istream& in, model * m, Sink& out, checksum& sum,
+		dedup * dd = 0) 
+{
+	// Blocks of fast engine are decoded without the model
+	if (m->engine == EngineFast)
+		return decode_blocks(in, out, sum);
 
 	decoder dec(in);
-	std::unique_ptr<model> m( model::instance(order, limit, 
-			(bootsize == 0), bootsize, (adaptsize > 0), adaptsize ) );
 
-	uint32 dist[ R(EOS) + 1 ];
+	uint32 dist[ R(EOS) + 1 ] = { 0 };
 
 	// Exclusion mask for chars which appeared in a higher order
 	uint64 x_mask[4];
 
+	// Output and checksum in blocks
+	char block[ BlockSize ];
+	uint32 blockp = 0;
+
+	// Output byte
+	auto put = [&](const uint8 b) {
+		block[blockp++] = b;
+		if (blockp == BlockSize) {
+			{
+				profile::timer check(PhaseChecksum);
+				sum.update(block, blockp);
+			}
+			profile::timer output(PhaseOutput);
+			out.write(block, blockp);
+			blockp = 0;
+		}
+	};
+
+	// Phases of sampled symbol are timed when profiling
+	profile * prof = profile::active;
+
 	// Read data: terminated by EOS symbol
-	boost::crc_32_type crc;
 	uint64 len = 0;
 	uint16 c = 0;
 	while (!dec.eof()) {
-		memset(x_mask, 0xFF, sizeof(long) * 4);
-		// Seek character range
-		for (int ord = m->order ; ord >= -1 ; --ord) {
-			m->dist(ord, dist, x_mask);
-			// Symbol c has frequency in context
-			if ((c = dec.decode(dist)) != Escape)
-				break;
-		} 
+		// Reference is copied from window of earlier output
+		if (dd) {
+			const bool ref = dec.decode_bit(dd->reffreq());
+			dd->coded(ref);
+			if (ref) {
+				const uint64 dist = dec.decode_int();
+				const uint64 n = dec.decode_int();
+				// Encoder extends references from DedupMin bytes up to
+				// DedupMaxLen, so other lengths are corrupt
+				if (n < (uint64)DedupMin || n > DedupMaxLen) {
+					throw std::range_error("reference length out of range");
+				}
+				if (!dd->valid(dist)) {
+					throw std::range_error("reference out of window");
+				}
+				for (uint64 i = 0 ; i < n ; ++i) {
+					const uint8 b = dd->at(dist);
+					dd->append(b);
+					put(b);
+				}
+				len += n;
+				continue;
+			}
+		}
+
+		const bool timed = (prof && prof->sample(PhaseDist));
+		uint64 t = (timed ? prof->clock() : 0);
+
+		// Byte as bits predicted by mixing engine, after bit for end
+		// of stream or sync flush point
+		bitmix * bm = m->mixer();
+		if (bm) {
+			if (dec.decode_bit(1))
+				c = (m->sync && !dec.decode_bit(BitTotal >> 1) 
+						? Escape : EOS);
+			else {
+				uint32 b = 1;
+				while (b < 256) {
+					const bool bit = dec.decode_bit(bm->p());
+					bm->update(bit);
+					b = ((b << 1) | bit);
+				}
+				c = (b & 0xFF);
+			}
+			if (timed) {
+				prof->add_sampled(PhaseCode, prof->clock() - t);
+				t = prof->clock();
+			}
+		}
+		else {
+			memset(x_mask, 0xFF, sizeof(long) * 4);
+			// Hit of long match is the predicted byte, miss excludes it
+			match * mm = m->matcher();
+			const int p = (mm ? mm->predicted() : -1);
+			bool hit = false;
+			if (p >= 0) {
+				hit = dec.decode_bit(mm->hitfreq());
+				STAT( m->matched(hit); )
+				if (hit)
+					c = p;
+				else
+					x_mask[ p >> 6 ] ^= ((1ULL << 63) >> (p & 63));
+				if (timed) {
+					prof->add_sampled(PhaseCode, prof->clock() - t);
+					t = prof->clock();
+				}
+			}
+			// Seek character range
+			for (int ord = (hit ? -1 : m->start()) ; !hit && ord >= -1 ; --ord) {
+				m->dist(ord, dist, x_mask);
+				if (timed) {
+					prof->add_sampled(PhaseDist, prof->clock() - t);
+					t = prof->clock();
+				}
+				// Symbol c has frequency in context
+				c = dec.decode(dist);
+				if (timed) {
+					prof->add_sampled(PhaseCode, prof->clock() - t);
+					t = prof->clock();
+				}
+				if (c != Escape) {
+					STAT( m->coded(ord); )
+					break;
+				}
+				STAT( m->escaped(ord); )
+			} 
+		}
+		// Escape in -1th order is sync flush point
+		if (c == Escape && m->sync) {
+			m->discard();
+			{
+				profile::timer check(PhaseChecksum);
+				sum.update(block, blockp);
+			}
+			profile::timer output(PhaseOutput);
+			out.write(block, blockp);
+			blockp = 0;
+			out.flush();
+			dec.sync();
+			continue;
+		}
 #ifndef UNSAFE
 		if (c == Escape) {
 			throw std::range_error("seek character range leaked escape");
@@ -64,135 +276,994 @@ long decompress(std::istream& in, std::ostream& out, std::ostream& err) {
 		}
 	
 		// Output
-		out << (char)c;
+		put(c);
+		if (dd)
+			dd->append(c);
 
 		// Update model
+		if (timed)
+			t = prof->clock();
 		m->update(c);
-		crc.process_byte(c);
+		if (timed)
+			prof->add_sampled(PhaseUpdate, prof->clock() - t);
 		++len;
 	}
-	if (dec.eof()) {
+	{
+		profile::timer check(PhaseChecksum);
+		sum.update(block, blockp);
+	}
+	{
+		profile::timer output(PhaseOutput);
+		out.write(block, blockp);
+	}
+	m->discard();
+
+	return (dec.eof() ? -1 : (long)len);
+}
+
+// Decompress frame after header has been read
+template <class Sink>
+static long decompress_frame(std::istream& in, const frame& f, Sink& out, 
+		std::ostream& err, workspace& ws, stats * st = 0) 
+{
+	model * m = ws.get(f.order, f.limit, (f.bootsize == 0), f.bootsize, 
+			(f.adaptsize > 0), f.adaptsize, f.sync, f.longmatch, f.skip,
+			f.growing(), f.fingerprint, f.split, f.engine,
+			dedup::footprint(f.dedupsize, false));
+
+	// Preallocate output for original length
+	if (f.size != SizeUnknown)
+		out.reserve(f.size);
+
+	// Window of dedup stage
+	dedup * dd = (f.dedupsize > 0 ? ws.window(f.dedupsize, false) : 0);
+
+	checksum sum(f.check);
+	long len = decode(in, m, out, sum, dd);
+	if (st)
+		st->add(m->counters());
+	if (len < 0) {
 		err << SELF << ": unexpected end of compressed data" << std::endl;
 		return -1;
 	}
 
-	// CRC check: 4 bytes at EOF
-	// FIXME Instead of until EOF; fixed amount of fluff after end of code
-	uint32 v = 0;
-	int b;
-	while ((b = in.get()) != -1)
-		v = ((v << 8) | (b & 0xFF));
-	if (v != crc.checksum()) {
+	// Trailer: original length and checksum
+	uint64 filelen;
+	uint32 v;
+	if (!f.read_trailer(in, filelen, v)) {
+		err << SELF << ": unexpected end of compressed data" << std::endl;
+		return -1;
+	}
+	if (filelen != SizeUnknown && filelen != (uint64)len) {
+		err << SELF << ": length does not match" << std::endl;
+		return -1;
+	}
+	if (v != sum.value()) {
 		err << SELF << ": checksum does not match"
 #ifdef VERBOSE
 			<< ": " << std::hex 
-			<< "out:" << crc.checksum() << " file:" << v << std::dec 
+			<< "out:" << sum.value() << " file:" << v << std::dec 
 #endif
 			<< std::endl;
 		return -1;
 	}
+	out.flush();
 
 	return len;
 }
 
-long compress(std::istream& in, std::ostream& out, std::ostream& err, 
-		const int order, const int limit, const long maxlen, 
-		const bool reset, const int bootsize,
-		const bool adapt, const int adaptsize ) 
+// Read header and decompress frame
+template <class Sink>
+static long decompress_frame(std::istream& in, Sink& out, std::ostream& err) {
+	frame f;
+	if (!f.read_header(in)) {
+		err << SELF << ": no magic" << std::endl << std::flush;
+		return -1;
+	}
+	workspace ws(0);
+	return decompress_frame(in, f, out, err, ws);
+}
+
+long decompress(std::istream& in, std::ostream& out, std::ostream& err) {
+	stats st;
+	return decompress(in, out, err, st);
+}
+
+long decompress(std::istream& in, std::ostream& out, std::ostream& err,
+		stats& st)
 {
-	// Magic
-	out << Magia << (char)0x00;
+	profile prof;
+	profile::scope active(st.profiling ? &prof : 0);
+	stream_sink sink(out);
+	// Model is reused for concatenated frames
+	workspace ws(0);
+	long len = 0;
+	do {
+		frame f;
+		if (!f.read_header(in)) {
+			err << SELF << ": no magic" << std::endl << std::flush;
+			return -1;
+		}
+		long n = decompress_frame(in, f, sink, err, ws, &st);
+		if (n < 0)
+			return -1;
+		len += n;
+	} while (in.peek() != EOF);
+	st.bytes += len;
+	if (st.profiling)
+		prof.collect(st);
+	return len;
+}
 
-	// Model order: 1 byte
-	out << (char)(order & 0xFF);
+long decompress(std::istream& in, std::string& out, std::ostream& err) {
+	string_sink sink(out);
+	return decompress_frame(in, sink, err);
+}
 
-	// Model memory limit: 2 bytes
-	out << (char)(limit >> 8) << (char)(limit & 0xFF);
+// Frame for compression options
+static frame options_frame(const options& opt) {
+	frame f;
+	f.order = opt.order;
+	f.sync = (opt.flushbytes > 0 || opt.flushlines > 0 || opt.flushms > 0);
+	f.limit = opt.limit;
+	f.bootsize = (opt.reset ? 0 : opt.bootsize);
+	f.adaptsize = (opt.adapt ? opt.adaptsize : 0);
+	// Fast engine codes blocks without the model
+	f.longmatch = (opt.longmatch && opt.engine != EngineFast);
+	f.skip = opt.skip;
+	f.fingerprint = opt.fingerprint;
+	f.split = opt.split;
+	f.engine = opt.engine;
+	if (opt.dedupsize < 0 || opt.dedupsize > DedupLimitMax) {
+		throw std::range_error( boost::str( boost::format(
+			"accepted range for dedup window is [0,%1%]") % DedupLimitMax ));
+	}
+	if (opt.engine == EngineFast && opt.dedupsize > 0) {
+		throw std::range_error("fast engine has no dedup stage");
+	}
+	f.dedupsize = opt.dedupsize;
+	return f;
+}
 
-	// Model bootstrap buffer length: 1 byte
-	out << (char)((reset ? 0 : bootsize) & 0xFF);
+// Worker threads for count of jobs
+static int options_jobs(const options& opt, const size_t n) {
+	int jobs = opt.jobs;
+	if (jobs <= 0)
+		jobs = std::max(1U, std::thread::hardware_concurrency());
+	return std::max(1, std::min(jobs, (int)n));
+}
 
-	// Model local adaptation length: 1 byte
-	out << (char)((adapt ? adaptsize : 0) & 0xFF);
+// Read sample for trial compressions
+static void read_sample(std::istream& in, const options& opt, 
+		std::string& sample)
+{
+	long n = AutoSample;
+	if (opt.maxlen > 0)
+		n = std::min(n, opt.maxlen);
+	sample.resize(n);
+	in.read(&sample[0], n);
+	sample.resize(in.gcount());
+}
 
-	// Use boost CRC even when hardware intrisics would be available.
-	// Just to be sure encoder/decoder use same CRC algorithm.
-	boost::crc_32_type crc;
-	
-	std::unique_ptr<model> m( model::instance(order, limit, 
-			reset, bootsize, adapt, adaptsize ) );
+// Literals of sample after dedup stage, which are coded by the model
+static std::string literals(const std::string& sample, dedup& dd) {
+	std::string lit;
+	uint64 dist;
+	uint64 n;
+	int v;
+	for (size_t p = 0 ; p <= sample.size() ; ++p) {
+		if (p < sample.size())
+			dd.push(sample[p]);
+		else
+			dd.flush();
+		while ((v = dd.next(dist, n)) != dedup::None)
+			if (v != dedup::Reference)
+				lit += (char)v;
+	}
+	return lit;
+}
 
-	uint32 dist[ R(EOS) + 1 ];
+// Options of smallest output in trial compressions of sample, or of
+// the smallest output at least target MB/s (fastest when none is);
+// orders with text keys and adaptation are tried, other options are
+// kept; trials run in jobs workers and reserve models from budget
+// when given
+// Processor time of calling thread in seconds
+static double thread_seconds() {
+	struct timespec t;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+	return (t.tv_sec + t.tv_nsec / 1e9);
+}
 
-	// Exclusion mask for chars which appeared in a higher order
-	uint64 x_mask[4];
+static options tune(const std::string& sample, const options& opt, 
+		const int jobs, budget * mem, std::ostream& err, 
+		const std::string& label)
+{
+	auto start = std::chrono::steady_clock::now();
+	std::vector<options> trials;
+	for (int ord = OrderMin ; ord <= TextOrderMax ; ++ord) {
+		for (int a = 0 ; a <= 1 ; ++a) {
+			options o = opt;
+			o.order = ord;
+			o.adapt = (a > 0);
+			trials.push_back(o);
+		}
+	}
+
+	// Dedup stage parses sample once and trials code its literals;
+	// references cost the same in every trial and are left out, time
+	// of parsing is added to each
+	std::string lit;
+	double parsesec = 0;
+	if (opt.dedupsize > 0) {
+		const double t = thread_seconds();
+		workspace parse(mem);
+		lit = literals(sample, *parse.window(opt.dedupsize, true));
+		parsesec = (thread_seconds() - t);
+	}
+	const std::string& input = (opt.dedupsize > 0 ? lit : sample);
+
+	// Compressed length and MB/s of each trial; speed is from processor
+	// time of the trial, so trials on other workers do not slow it down
+	std::vector<uint64> size(trials.size());
+	std::vector<double> speed(trials.size());
+	const int n = std::max(1, std::min(jobs, (int)trials.size()));
+	std::vector< std::unique_ptr<workspace> > ws;
+	for (int w = 0 ; w < n ; ++w)
+		ws.push_back(std::unique_ptr<workspace>(new workspace(mem)));
+	scheduler sched(n);
+	sched.at_exit([&](const int w) { ws[w]->drop(); });
+	for (size_t i = 0 ; i < trials.size() ; ++i) {
+		sched.add([&, i](const int w) {
+			const options& o = trials[i];
+			frame f = options_frame(o);
+			model * m = ws[w]->get(o.order, o.limit, o.reset, o.bootsize,
+					o.adapt, o.adaptsize, f.sync, f.longmatch, f.skip,
+					f.growing(), f.fingerprint, f.split, f.engine, 0);
+			const double t = thread_seconds();
+			std::ostream null(0);
+			compressor cmp(null, m, f.check);
+			for (size_t p = 0 ; p < input.size() ; ++p)
+				cmp.put(input[p]);
+			cmp.finish();
+			double sec = parsesec + (thread_seconds() - t);
+			size[i] = cmp.outlen();
+			speed[i] = (sec > 0 ? sample.size() / sec / 1e6 : 0.0);
+		});
+	}
+	sched.run();
+
+	size_t best = 0;
+	for (size_t i = 1 ; i < trials.size() ; ++i) {
+		bool fast = (speed[i] >= opt.target);
+		bool bestfast = (speed[best] >= opt.target);
+		if ((fast && !bestfast) 
+				|| (fast == bestfast && (fast ? size[i] < size[best] 
+					: speed[i] > speed[best])))
+			best = i;
+	}
+
+	const options& o = trials[best];
+	err << SELF << ": " << label << "auto -o " << o.order;
+	if (o.adapt)
+		err << " -a -A " << o.adaptsize;
+	err << " at " << std::fixed << std::setprecision(3) 
+		<< (sample.size() > 0 ? size[best] * 8.0 / sample.size() : 0.0) 
+		<< " bpc " << std::setprecision(1) << speed[best] << " MB/s from " 
+		<< trials.size() << " trials of " << sample.size() << " bytes in "
+		<< std::setprecision(3) << std::chrono::duration<double>(
+				std::chrono::steady_clock::now() - start).count() 
+		<< " s" << std::endl;
+	return o;
+}
+
+// Input of descriptor is readable, or at end, within milliseconds
+static const bool readable(const int fd, const long ms) {
+	struct pollfd p;
+	p.fd = fd;
+	p.events = POLLIN;
+	p.revents = 0;
+	return (poll(&p, 1, (int)std::max(ms, 0L)) != 0);
+}
+
+// Compress input to frame using model and dedup stage when given,
+// label is prefix for report, timeline is written to trace when given;
+// descriptor of input is polled for sync flush by time while input
+// stalls (-1 is none)
+static long compress_frame(std::istream& in, std::ostream& out, 
+		std::ostream& err, frame& f, model * m, dedup * dd, 
+		const options& opt,
+		const std::string& label, trace * tr = 0, const int fd = -1)
+{
+	const bool sync = f.sync;
+	const long maxlen = opt.maxlen;
+	const long flushbytes = opt.flushbytes;
+	const long flushlines = opt.flushlines;
+	const long flushms = opt.flushms;
+
+	// Original length when input is seekable
+	std::streampos at = in.tellg();
+	if (at != std::streampos(-1) && in.seekg(0, std::ios::end)) {
+		std::streampos end = in.tellg();
+		if (end != std::streampos(-1) && in.seekg(at)) {
+			f.size = (end - at);
+			if (maxlen > 0 && f.size > (uint64)maxlen)
+				f.size = maxlen;
+		}
+	}
+	in.clear();
+
+	f.write_header(out);
 
 	// Write data: terminated by EOS symbol
-	encoder enc(out);
-	uint64 len = 0;
-	char b;
-	while (in.get(b)) {
-		int c = (0xFF & b);
-		memset(x_mask, 0xFF, sizeof(long) * 4);
-		// Seek character range
-		for (int ord = m->order ; ord >= -1 ; --ord) {
-			m->dist(ord, dist, x_mask);
-			// Symbol c has frequency in context
-			if (dist[ L(c) ] != dist[ R(c) ])
+	compressor cmp(out, m, f.check, dd);
+
+	// Sync flush point triggers
+	long bytes = 0;
+	long lines = 0;
+	uint64 synced = 0;
+	auto deadline = std::chrono::steady_clock::now() 
+		+ std::chrono::milliseconds(flushms);
+
+	// Input read of sampled byte is timed when profiling
+	profile * prof = profile::active;
+
+	// Hardware counters around coding loop
+	std::unique_ptr<perfcount> counters;
+	if (opt.perf) {
+		counters.reset(new perfcount());
+		counters->start();
+	}
+
+	// Bytes are taken from stream buffer without sentry of each get
+	std::streambuf * src = in.rdbuf();
+
+	// Fast engine reads whole blocks unless a byte may end one early
+	const bool bulk = (m->engine == EngineFast && !dd && !sync && !tr);
+	if (bulk) {
+		std::unique_ptr<char[]> chunk(new char[ FastBlock ]);
+		while (true) {
+			std::streamsize want = FastBlock;
+			if (maxlen > 0 && (long)cmp.len() + want > maxlen)
+				want = (maxlen - (long)cmp.len());
+			std::streamsize k;
+			{
+				profile::timer input(PhaseInput);
+				k = src->sgetn(chunk.get(), want);
+			}
+			if (k <= 0)
 				break;
-			// Output escape when symbol c has zero frequency
-			enc.encode(Escape, dist); 
-		} 
-		
-		// Output
-#ifndef UNSAFE
-		if (dist[ L(c) ] == dist[ R(c) ]) {
-			throw std::range_error(
-				boost::str ( boost::format("zero frequency for symbol %1%") % (int)c ) 
-			);
+			cmp.write(chunk.get(), k);
 		}
-#endif
-		enc.encode(c, dist);
+	}
 
-		// Update model
-		m->update(c);
-		crc.process_byte(c);
+	int v;
+	while (!bulk) {
+		// Pending bytes are flushed at deadline also when input stalls
+		if (sync && flushms > 0 && fd >= 0 && cmp.len() > synced 
+				&& src->in_avail() <= 0) {
+			const long ms = std::chrono::duration_cast<
+				std::chrono::milliseconds>(
+					deadline - std::chrono::steady_clock::now()).count();
+			if (!readable(fd, ms)) {
+				cmp.sync();
+				synced = cmp.len();
+				bytes = lines = 0;
+				deadline = std::chrono::steady_clock::now() 
+					+ std::chrono::milliseconds(flushms);
+				continue;
+			}
+		}
+		if (prof && prof->sample(PhaseInput)) {
+			uint64 t = prof->clock();
+			v = src->sbumpc();
+			prof->add_sampled(PhaseInput, prof->clock() - t);
+		}
+		else
+			v = src->sbumpc();
+		if (v == std::streambuf::traits_type::eof())
+			break;
+		const char b = (char)v;
+		cmp.put(b);
+
+		// Sync flush point after interval of bytes, lines or time
+		if (sync) {
+			bool flush = ((flushbytes > 0 && ++bytes >= flushbytes)
+				|| (flushlines > 0 && b == '\n' && ++lines >= flushlines));
+			if (!flush && flushms > 0) {
+				auto now = std::chrono::steady_clock::now();
+				flush = (now >= deadline);
+			}
+			if (flush) {
+				cmp.sync();
+				synced = cmp.len();
+				bytes = lines = 0;
+				deadline = std::chrono::steady_clock::now() 
+					+ std::chrono::milliseconds(flushms);
+			}
+		}
+
+		if (tr && tr->due(cmp.len()))
+			tr->record(cmp.len(), cmp.outlen(), m);
 
 		// Process only prefix amount of bytes
-		if (++len == maxlen)
+		if ((long)cmp.len() == maxlen)
 			break;
 	}
-	// Escape to -1 level, output EOS
-	memset(x_mask, 0xFF, sizeof(long) * 4);
-	for (int ord = m->order ; ord >= 0 ; --ord) {
-		m->dist(ord, dist, x_mask);
-		enc.encode(Escape, dist); 
-	} 
-	m->dist(-1, dist, x_mask);
-#ifndef UNSAFE
-	if (dist[ L(EOS) ] == dist[ R(EOS) ]) {
-		throw std::range_error("zero frequency for EOS");
-	}
-#endif
-	enc.encode(EOS, dist);
 
-	// Write pending output 
-	enc.finish();
+	// Write EOS and pending output 
+	cmp.finish();
+	if (tr)
+		tr->finish(cmp.len(), cmp.outlen(), m);
+	if (counters)
+		counters->stop();
 	
-	// Write checksum: 4 bytes
-	uint32 v = crc.checksum();
-	out << (char)(v >> 24) << (char)((v >> 16) & 0xFF) 
-		<< (char)((v >> 8) & 0xFF) << (char)(v & 0xFF);
+	// Write original length and checksum
+	f.write_trailer(out, cmp.len(), cmp.checksum());
 
-	// Length: magic + order + limit + bootsize + adapt + code + crc
-	uint64 outlen = sizeof(Magia) + 1 + 2 + 1 + 1 + enc.len() + 4 ; 
+	// Length: header + code + trailer
+	uint64 len = cmp.len();
+	uint64 outlen = f.header_len() + cmp.outlen() + f.trailer_len(); 
 	double bpc = ((outlen / (double)len) * 8.0);
 	
-	err << SELF << ": in " << len << " -> out " << outlen << " at " 
-		<< std::fixed << std::setprecision(3) << bpc << " bpc" 
-		<< std::endl << std::flush;
+	err << SELF << ": " << label << "in " << len << " -> out " << outlen << " at " 
+		<< std::fixed << std::setprecision(3) << bpc << " bpc";
+	if (sync)
+		err << " with " << cmp.syncs() << " sync flush points";
+	if (dd)
+		err << " with " << dd->copied() << " bytes deduplicated";
+	err << std::endl;
+	if (counters) {
+		err << SELF << ": " << label;
+		counters->report(err, len);
+		err << std::endl;
+	}
+	err << std::flush;
 	
 	return len;
 }
 
+long compress(std::istream& in, std::ostream& out, std::ostream& err, 
+		const options& opt)
+{
+	stats st;
+	return compress(in, out, err, opt, st);
+}
+
+long compress(std::istream& in, std::ostream& out, std::ostream& err, 
+		const options& given, stats& st)
+{
+	// Settings by trial compressions of sample, which is read again
+	// from seekable input or else ahead of the rest of input
+	options opt = given;
+	std::string sample;
+	std::unique_ptr<prefix_buf> joined_buf;
+	std::unique_ptr<std::istream> joined;
+	if (opt.autotune) {
+		std::streampos at = in.tellg();
+		read_sample(in, opt, sample);
+		// Each worker holds a model of the memory limit, so trials run
+		// one after another unless jobs are given
+		opt = tune(sample, opt, std::max(1, opt.jobs), 0, err, "");
+		in.clear();
+		if (at == std::streampos(-1) || !in.seekg(at)) {
+			in.clear();
+			joined_buf.reset(new prefix_buf(sample, in.rdbuf()));
+			joined.reset(new std::istream(joined_buf.get()));
+		}
+	}
+	std::istream& src = (joined ? *joined : in);
+
+	profile prof;
+	profile::scope active(st.profiling ? &prof : 0);
+	frame f = options_frame(opt);
+	workspace ws(0);
+	model * m = ws.get(opt.order, opt.limit, opt.reset, opt.bootsize, 
+			opt.adapt, opt.adaptsize, f.sync, f.longmatch, f.skip,
+			f.growing(), f.fingerprint, f.split, f.engine,
+			dedup::footprint(f.dedupsize, true));
+	// Timeline of compression
+	std::ofstream trace_out;
+	std::unique_ptr<trace> tr;
+	if (!opt.trace.empty()) {
+		trace_out.open(opt.trace.c_str(), std::ios::trunc);
+		if (!trace_out) {
+			err << SELF << ": " << opt.trace << ": cannot open" << std::endl;
+			return -1;
+		}
+		tr.reset(new trace(trace_out, opt.tracebytes));
+	}
+
+	// Standard input is polled for sync flush by time
+	const int fd = (in.rdbuf() == std::cin.rdbuf() ? STDIN_FILENO : -1);
+	long len = compress_frame(src, out, err, f, m, 
+			(f.dedupsize > 0 ? ws.window(f.dedupsize, true) : 0), opt, "", 
+			tr.get(), fd);
+	st.add(m->counters());
+	st.bytes += len;
+	if (st.profiling)
+		prof.collect(st);
+	return len;
+}
+
+// Name of member is relative path without parent references
+static const bool safe_name(const std::string& name) {
+	if (name.empty() || name[0] == '/')
+		return false;
+	std::string part;
+	std::istringstream parts(name);
+	while (std::getline(parts, part, '/'))
+		if (part == "..")
+			return false;
+	return true;
+}
+
+// Member name of path: relative, without empty, '.' or '..' parts,
+// where '..' removes the part before it; empty if nothing is left
+static std::string member_name(const std::string& path) {
+	std::vector<std::string> parts;
+	std::string part;
+	std::istringstream in(path);
+	while (std::getline(in, part, '/')) {
+		if (part.empty() || part == ".")
+			continue;
+		if (part == "..") {
+			if (!parts.empty())
+				parts.pop_back();
+			continue;
+		}
+		parts.push_back(part);
+	}
+	std::string name;
+	for (auto it = parts.begin() ; it != parts.end() ; ++it)
+		name += (name.empty() ? "" : "/") + *it;
+	return name;
+}
+
+// Create parent directories of member, returns false on failure
+static const bool make_parents(const std::string& name) {
+	for (size_t p = name.find('/') ; p != std::string::npos ; 
+			p = name.find('/', p + 1)) {
+		const std::string dir = name.substr(0, p);
+		if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+			return false;
+	}
+	return true;
+}
+
+// Largest memory limit and window of dedup stage in first frames of
+// files, 0 when none is read
+static int frames_limit(const std::vector<std::string>& paths) {
+	int limit = 0;
+	for (auto it = paths.begin() ; it != paths.end() ; ++it) {
+		std::ifstream in(it->c_str(), std::ios::binary);
+		frame f;
+		if (in && f.read_header(in))
+			limit = std::max(limit, (int)f.limit 
+					+ dedup::footprint(f.dedupsize, false));
+	}
+	return limit;
+}
+
+// Length of file or 0 if not known
+static uint64 file_size(const std::string& path) {
+	struct stat st;
+	if (stat(path.c_str(), &st) != 0)
+		return 0;
+	return st.st_size;
+}
+
+int compress_files(const std::vector<std::string>& paths, 
+		const std::string& archive, const options& opt, std::ostream& err,
+		stats& st)
+{
+	int jobs = options_jobs(opt, paths.size());
+
+	// Workers beyond memory budget would only wait for others; each
+	// holds a model and a window of dedup stage
+	std::unique_ptr<budget> mem;
+	if (opt.budget > 0) {
+		const int limit = opt.limit + dedup::footprint(opt.dedupsize, true);
+		if (opt.budget < limit) {
+			err << SELF << ": memory limit is larger than budget" << std::endl;
+			return paths.size();
+		}
+		mem.reset(new budget(opt.budget));
+		jobs = std::min(jobs, (int)(opt.budget / limit));
+	}
+
+	std::ofstream archive_out;
+	if (!archive.empty()) {
+		archive_out.open(archive.c_str(), std::ios::binary | std::ios::trunc);
+		if (!archive_out) {
+			err << SELF << ": " << archive << ": cannot open" << std::endl;
+			return paths.size();
+		}
+	}
+
+	// Model of each worker is kept for all files it compresses
+	std::vector< std::unique_ptr<workspace> > ws;
+	for (int w = 0 ; w < jobs ; ++w)
+		ws.push_back(std::unique_ptr<workspace>(new workspace(mem.get())));
+
+	std::mutex out_lock;
+	std::atomic<int> failed(0);
+	std::atomic<bool> renamed(false);
+
+	// Largest files are at the back of queues, where workers take 
+	// their own jobs from, and small files are left for stealing
+	std::vector<std::pair<uint64, std::string> > order;
+	for (auto it = paths.begin() ; it != paths.end() ; ++it)
+		order.push_back(std::make_pair(file_size(*it), *it));
+	std::stable_sort(order.begin(), order.end(), 
+		[](const std::pair<uint64, std::string>& a, 
+				const std::pair<uint64, std::string>& b) {
+			return a.first < b.first;
+		});
+
+	const options& given = opt;
+	scheduler sched(jobs);
+
+	// Worker which quits releases its model to workers still waiting
+	sched.at_exit([&](const int w) { ws[w]->drop(); });
+	for (auto it = order.begin() ; it != order.end() ; ++it) {
+		const std::string path = it->second;
+		sched.add([&, path](const int w) {
+			std::ostringstream msg;
+			profile prof;
+			profile::scope active(st.profiling ? &prof : 0);
+			std::ifstream in(path.c_str(), std::ios::binary);
+			if (!in) {
+				msg << SELF << ": " << path << ": cannot open" << std::endl;
+				++failed;
+			}
+			else {
+				// Trials of file in this worker, other workers have files;
+				// trial models take the budget of the worker's model
+				options opt = given;
+				if (opt.autotune) {
+					std::string sample;
+					read_sample(in, opt, sample);
+					ws[w]->drop();
+					opt = tune(sample, opt, 1, mem.get(), msg, path + ": ");
+					in.clear();
+					in.seekg(0);
+				}
+				frame f = options_frame(opt);
+				model * m = ws[w]->get(opt.order, opt.limit, opt.reset, 
+						opt.bootsize, opt.adapt, opt.adaptsize, f.sync,
+						f.longmatch, f.skip, f.growing(),
+						f.fingerprint, f.split, f.engine,
+						dedup::footprint(f.dedupsize, true));
+				dedup * dd = (f.dedupsize > 0 
+						? ws[w]->window(f.dedupsize, true) : 0);
+				long len = 0;
+				if (archive.empty()) {
+					std::string outpath = path + Suffix;
+					std::ofstream out(outpath.c_str(), 
+							std::ios::binary | std::ios::trunc);
+					if (!out || (len = compress_frame(in, out, msg, f, m, dd,
+							opt, path + ": ")) < 0 || !out.flush()) {
+						msg << SELF << ": " << outpath << ": cannot write" 
+							<< std::endl;
+						++failed;
+					}
+				}
+				else if ((f.name = member_name(path)).empty()) {
+					msg << SELF << ": " << path << ": no member name" 
+						<< std::endl;
+					++failed;
+				}
+				else {
+					// Member names are relative, as they are extracted
+					if (f.name != path && !renamed.exchange(true))
+						msg << SELF << ": removing leading '/' and '..' "
+							"from member names" << std::endl;
+
+					// Frames are written to archive in order of completion
+					std::ostringstream out;
+					len = compress_frame(in, out, msg, f, m, dd, opt, 
+							path + ": ");
+					std::lock_guard<std::mutex> guard(out_lock);
+					archive_out << out.str();
+				}
+				stats counts = m->counters();
+				counts.bytes = std::max(len, 0L);
+				if (st.profiling)
+					prof.collect(counts);
+				std::lock_guard<std::mutex> guard(out_lock);
+				st.add(counts);
+			}
+			std::lock_guard<std::mutex> guard(out_lock);
+			err << msg.str() << std::flush;
+		});
+	}
+	sched.run();
+
+#ifdef VERBOSE
+	for (int w = 0 ; w < jobs ; ++w)
+		err << "worker " << w << " models allocated:" << ws[w]->allocs() 
+			<< " reused:" << ws[w]->reuses() << std::endl;
+#endif
+
+	if (!archive.empty() && !archive_out.flush()) {
+		err << SELF << ": " << archive << ": cannot write" << std::endl;
+		return paths.size();
+	}
+
+	return failed;
+}
+
+int decompress_files(const std::vector<std::string>& paths, 
+		const std::string& archive, const options& opt, std::ostream& err,
+		stats& st)
+{
+	std::unique_ptr<budget> mem;
+	if (opt.budget > 0)
+		mem.reset(new budget(opt.budget));
+
+	// Frames of archive to files by member names, one after another
+	if (!archive.empty()) {
+		std::ifstream in(archive.c_str(), std::ios::binary);
+		if (!in) {
+			err << SELF << ": " << archive << ": cannot open" << std::endl;
+			return 1;
+		}
+		profile prof;
+		profile::scope active(st.profiling ? &prof : 0);
+		workspace ws(mem.get());
+		int failed = 0;
+		while (in.peek() != EOF) {
+			frame f;
+			if (!f.read_header(in)) {
+				err << SELF << ": " << archive << ": no magic" << std::endl;
+				return failed + 1;
+			}
+			if (!safe_name(f.name)) {
+				err << SELF << ": " << archive << ": bad member name '" 
+					<< f.name << "'" << std::endl;
+				return failed + 1;
+			}
+			if (!make_parents(f.name)) {
+				err << SELF << ": " << f.name << ": cannot create directory" 
+					<< std::endl;
+				return failed + 1;
+			}
+			std::ofstream out(f.name.c_str(), 
+					std::ios::binary | std::ios::trunc);
+			if (!out) {
+				err << SELF << ": " << f.name << ": cannot open" << std::endl;
+				return failed + 1;
+			}
+			stream_sink sink(out);
+			long len = decompress_frame(in, f, sink, err, ws, &st);
+			if (len < 0)
+				return failed + 1;
+			st.bytes += len;
+			if (!out.flush()) {
+				err << SELF << ": " << f.name << ": cannot write" << std::endl;
+				++failed;
+			}
+		}
+		if (st.profiling)
+			prof.collect(st);
+		return failed;
+	}
+
+	// Each file.pim to file; workers beyond memory budget would only
+	// wait for others. Later frames may need more than the first, which
+	// workspace reserves at once so workers do not wait on each other
+	int jobs = options_jobs(opt, paths.size());
+	if (mem) {
+		const int limit = frames_limit(paths);
+		if (opt.budget < limit) {
+			err << SELF << ": memory limit is larger than budget" << std::endl;
+			return paths.size();
+		}
+		if (limit > 0)
+			jobs = std::max(1, std::min(jobs, (int)(opt.budget / limit)));
+	}
+	std::vector< std::unique_ptr<workspace> > ws;
+	for (int w = 0 ; w < jobs ; ++w)
+		ws.push_back(std::unique_ptr<workspace>(new workspace(mem.get())));
+
+	std::mutex err_lock;
+	std::atomic<int> failed(0);
+
+	scheduler sched(jobs);
+
+	// Worker which quits releases its model to workers still waiting
+	sched.at_exit([&](const int w) { ws[w]->drop(); });
+	for (auto it = paths.begin() ; it != paths.end() ; ++it) {
+		const std::string path = *it;
+		sched.add([&, path](const int w) {
+			std::ostringstream msg;
+			stats counts;
+			profile prof;
+			profile::scope active(st.profiling ? &prof : 0);
+			const size_t n = sizeof(Suffix) - 1;
+			std::string outpath;
+			if (path.size() > n 
+					&& path.compare(path.size() - n, n, Suffix) == 0)
+				outpath = path.substr(0, path.size() - n);
+			std::ifstream in(path.c_str(), std::ios::binary);
+			if (outpath.empty()) {
+				msg << SELF << ": " << path << ": unknown suffix" << std::endl;
+				++failed;
+			}
+			else if (!in) {
+				msg << SELF << ": " << path << ": cannot open" << std::endl;
+				++failed;
+			}
+			else {
+				std::ofstream out(outpath.c_str(), 
+						std::ios::binary | std::ios::trunc);
+				stream_sink sink(out);
+				// Concatenated frames
+				long len = 0;
+				do {
+					frame f;
+					if (!f.read_header(in)) {
+						msg << SELF << ": " << path << ": no magic" << std::endl;
+						len = -1;
+					}
+					else
+						len = decompress_frame(in, f, sink, msg, *ws[w], 
+								&counts);
+					if (len > 0)
+						counts.bytes += len;
+				} while (len >= 0 && in.peek() != EOF);
+				if (len < 0)
+					++failed;
+				else if (!out.flush()) {
+					msg << SELF << ": " << outpath << ": cannot write" 
+						<< std::endl;
+					++failed;
+				}
+			}
+			if (st.profiling)
+				prof.collect(counts);
+			std::lock_guard<std::mutex> guard(err_lock);
+			st.add(counts);
+			err << msg.str() << std::flush;
+		});
+	}
+	sched.run();
+
+	return failed;
+}
+
+#ifdef STATS
+// Array of counters as JSON
+static void report_array(std::ostream& out, const uint64 * v, const int n) {
+	out << "[";
+	for (int i = 0 ; i < n ; ++i)
+		out << (i > 0 ? "," : "") << v[i];
+	out << "]";
+}
+#endif
+
+void report(std::ostream& out, const stats& st) {
+	out << "{\"resets\":" << st.resets << ",\"rescales\":" << st.rescales
+		<< ",\"bootstraps\":" << st.bootstraps;
+#ifdef STATS
+	out << ",\"probes\":" << st.probes 
+		<< ",\"hits_h1\":" << st.hits_h1 << ",\"hits_h2\":" << st.hits_h2
+		<< ",\"kicks\":";
+	report_array(out, st.kicks, KickBuckets);
+	out << ",\"escapes\":";
+	report_array(out, st.escapes, OrderMax + 2);
+	out << ",\"coded\":";
+	report_array(out, st.coded, OrderMax + 2);
+	out << ",\"match_hits\":" << st.match_hits
+		<< ",\"match_misses\":" << st.match_misses
+		<< ",\"skips\":" << st.skips
+		<< ",\"cached\":";
+	report_array(out, st.cached, OrderMax + 1);
+	out << ",\"uncached\":";
+	report_array(out, st.uncached, OrderMax + 1);
+	out << ",\"rescales_maxfreq\":" << st.rescales_maxfreq
+		<< ",\"rescales_coder\":" << st.rescales_coder
+		<< ",\"rescales_adapt\":" << st.rescales_adapt
+		<< ",\"grows\":" << st.grows
+		<< ",\"resets_maxloop\":" << st.resets_maxloop
+		<< ",\"resets_followers\":" << st.resets_followers
+		<< ",\"bootstrap_seconds\":";
+	std::ios::fmtflags flags = out.flags();
+	std::streamsize precision = out.precision();
+	out << std::fixed << std::setprecision(6) << st.bootstrap_seconds;
+	out.flags(flags);
+	out.precision(precision);
+#endif
+	out << "}";
+}
+
+void report_profile(std::ostream& out, const stats& st, 
+		const std::string& label)
+{
+	static const char * Names[] = { "dist", "update", "code", "checksum",
+		"reset", "rescale", "bootstrap", "grow", "input", "output" };
+	const double n = (st.bytes > 0 ? (double)st.bytes : 1.0);
+	uint64 sum = 0;
+	out << SELF << ": profile " << label << " " << st.bytes << " bytes" 
+		<< std::endl << std::fixed << std::setprecision(1);
+	for (int i = 0 ; i < Phases ; ++i) {
+		sum += st.cycles[i];
+		out << "  " << std::left << std::setw(10) << Names[i] << std::right 
+			<< std::setw(10) << (st.cycles[i] / n) << " cycles/byte" 
+			<< std::setw(7) << (100.0 * st.cycles[i] / st.cycles_total) 
+			<< "%" << std::endl;
+	}
+	uint64 other = (st.cycles_total > sum ? st.cycles_total - sum : 0);
+	out << "  " << std::left << std::setw(10) << "other" << std::right 
+		<< std::setw(10) << (other / n) << " cycles/byte" 
+		<< std::setw(7) << (100.0 * other / st.cycles_total) << "%" 
+		<< std::endl
+		<< "  " << std::left << std::setw(10) << "total" << std::right 
+		<< std::setw(10) << (st.cycles_total / n) << " cycles/byte" 
+		<< std::endl;
+}
+
+// Model after priming data, shared read-only by messages
+class snapshot {
+public:
+	snapshot(model * primed) : m(primed) {}
+	std::unique_ptr<model> m;
+};
+
+std::shared_ptr<const snapshot> prime(std::istream& in, const options& opt) {
+	frame f = options_frame(opt);
+	std::unique_ptr<model> m( model::instance(opt.order, opt.limit, 
+			opt.reset, opt.bootsize, opt.adapt, opt.adaptsize, f.sync,
+			f.longmatch, f.skip, f.growing(), f.fingerprint,
+			f.split, f.engine) );
+
+	// Compress priming data without output
+	std::ostream null(0);
+	compressor cmp(null, m.get(), f.check);
+	char b;
+	while (in.get(b))
+		cmp.put(b);
+
+	return std::shared_ptr<const snapshot>(new snapshot(m.release()));
+}
+
+long compress(const snapshot& base, const char * msg, const size_t n, 
+		std::string& out)
+{
+	std::unique_ptr<model> m( base.m->clone() );
+	string_buf buf(out);
+	std::ostream code(&buf);
+	compressor cmp(code, m.get(), CheckCRC32C);
+	cmp.write(msg, n);
+	cmp.finish();
+
+	// Checksum of message: 4 bytes
+	const uint32 v = cmp.checksum();
+	for (int i = 3 ; i >= 0 ; --i)
+		code << (char)((v >> (i << 3)) & 0xFF);
+	return cmp.outlen() + 4;
+}
+
+long decompress(const snapshot& base, const char * code, const size_t n, 
+		std::string& out)
+{
+	std::unique_ptr<model> m( base.m->clone() );
+	array_buf buf(code, n);
+	std::istream in(&buf);
+	string_sink sink(out);
+	checksum sum(CheckCRC32C);
+	const long len = decode(in, m.get(), sink, sum);
+	if (len < 0)
+		return -1;
+
+	// Checksum of message: 4 bytes
+	uint32 v = 0;
+	for (int i = 0 ; i < 4 ; ++i)
+		v = ((v << 8) | (in.get() & 0xFF));
+	if (!in.good() || v != sum.value())
+		return -1;
+	return len;
+}
+
 } // namespace
@@ -7,6 +7,10 @@
 #pragma once
 
 #include <iostream>
+#include <string>
+#include <vector>
+#include <memory>
+#include <cstring>
 #include <boost/cstdint.hpp>
 
 #include "pompomdefs.hpp"
@@ -28,6 +32,25 @@ static const int EOS = (Alpha + 2);
 // Compressed file magic header
 static const char Magia[] = "pim";
 
+// Compressed frame format version
+static const uint8 FrameVersion = 9;
+
+// Suffix of compressed files
+static const char Suffix[] = ".pim";
+
+// Maximum length of member name in frame
+static const int NameMax = 4095;
+
+// Frame checksum types (frames before version 2 use CRC32)
+static const uint8 CheckCRC32 = 0;
+static const uint8 CheckCRC32C = 1;
+
+// Length of blocks for checksum and output
+static const int BlockSize = 32768;
+
+// Original length is not known
+static const uint64 SizeUnknown = ~0ULL;
+
 // Adaptation threshold 
 static const int AdaptMin = 8;
 static const int AdaptDefault = 22;
@@ -41,16 +64,137 @@ static const int BootMax = 255;
 // Model order limits
 static const int OrderMin = 1;
 static const int OrderDefault = 3;
-static const int OrderMax = 6;
+static const int OrderMax = 16;
+
+// Largest order of which context keys hold text; longer contexts of
+// higher orders are hashed
+static const int TextOrderMax = 6;
 
 // Model memory limits 
 static const int LimitMin = 8;
 static const int LimitDefault = 32;
-static const int LimitMax = 2048;
+static const int LimitMax = 131072;
+
+// Starting memory of growing context table in MiB
+static const int GrowStart = 1;
+
+// Memory split to context tables: one shared table, even shares or
+// shares rising with length of context
+static const int SplitShared = 0;
+static const int SplitEven = 1;
+static const int SplitRising = 2;
+static const int SplitMax = 2;
+
+// Memory taken by a context with its followers in split tables, and
+// longest context key (less order 0) of which all contexts may fit
+static const int SplitContextBytes = 64;
+static const int SplitCapOrder = 3;
+
+// Least memory of a split table in bytes
+static const int SplitTableMin = (64 << 10);
+
+// Coding engine: PPM escape ladder over bytes, mixing of binary
+// predictions of bits, or static order-0/1 blocks coded with rANS
+static const int EnginePPM = 0;
+static const int EngineMix = 1;
+static const int EngineFast = 2;
+static const int EngineMax = 2;
+
+// Fast engine: bytes in a block, interleaved rANS states and
+// frequencies scaled to 1 << FastScaleBits, or in order-1 contexts to
+// 1 << FastScaleBits1 so their decoding tables stay in cache
+static const int FastBlock = (1 << 20);
+static const int FastLanes = 4;
+static const int FastScaleBits = 12;
+static const int FastScaleBits1 = 10;
+
+// Fast engine: lower bound of rANS state, renormalized by 16 bits
+static const uint32 FastLow = (1 << 15);
+
+// Fast engine block is stored, or coded in order-0 or order-1 context
+static const int FastStored = 0;
+static const int FastOrder0 = 1;
+static const int FastOrder1 = 2;
+
+// Learning rate of mixer weights
+static const int MixRate = 1;
+
+// Largest count of bit predictor, slowest rate is 1/(count+1.5)
+static const int MixCountMax = 15;
+
+// Buckets where a context of mixing engine can be kept
+static const int MixWays = 8;
+
+// Rate of adaptive probability map of mixing engine, 1/2^rate
+static const int MixApmRate = 7;
+
+// Entries of distribution cache in powers of two
+static const int DistCacheBits = 10;
 
 // Default for max n bytes
 static const int CountDefault = 0;
 
+// Default for sync flush point intervals (0 is no sync flush points)
+static const int FlushDefault = 0;
+
+// Default worker threads for many files (0 is hardware threads)
+static const int JobsDefault = 0;
+
+// Default memory budget in MiB (0 is memory limit times workers)
+static const int BudgetDefault = 0;
+
+// Sample length in bytes for trial compressions of automatic settings
+static const long AutoSample = (1 << 20);
+
+// Default input bytes between trace records
+static const long TraceDefault = (1 << 20);
+
+// Order byte flag in header for stream with sync flush points
+static const uint8 SyncFlag = 0x80;
+
+// Order byte flag in header for stream with long-match model
+static const uint8 MatchFlag = 0x40;
+
+// Order byte flag in header for stream with start order skipping
+static const uint8 SkipFlag = 0x20;
+
+// Order byte flag in header for stream with 16-bit key fingerprints
+static const uint8 FingerprintFlag = 0x08;
+
+// Order bits in order byte; from version 7 order has a byte of its own
+static const uint8 OrderBits = 0x07;
+
+// Skip order when probability of symbol in context is below, 16 bits
+static const uint16 SkipThreshold = (1 << 12);
+
+// Adaptation rate of probability of symbol in context in bits
+static const int SkipRate = 5;
+
+// Shortest match predicted by long-match model
+static const int MatchMin = 24;
+
+// Buckets of match lengths in powers of two for hit probability
+static const int MatchBuckets = 16;
+
+// Adaptation rate of hit probability in bits
+static const int MatchRate = 5;
+
+// Deduplication window in MiB (0 is no deduplication)
+static const int DedupDefault = 0;
+static const int DedupLimitMax = 2048;
+
+// Shortest duplicate run replaced with reference
+static const int DedupMin = 64;
+
+// Average distance of anchors in bytes (power of two)
+static const int DedupAnchor = 16;
+
+// Longest reference
+static const uint64 DedupMaxLen = (1 << 30);
+
+// Adaptation rate of reference probability in bits
+static const int DedupRate = 5;
+
 // Number of bits in a code value 
 static const int CodeValueBits = 32;
 
@@ -63,6 +207,10 @@ static const uint64 MaxFrequency = (((uint64) 1 << 16) - 1);
 // Encoder numerical limits rescale threshold 
 static const uint64 CoderRescale = ((1 << 24) - 1);
 
+// Total frequency of binary symbol
+static const int BitTotalBits = 12;
+static const uint32 BitTotal = (1 << BitTotalBits);
+
 // Point after first quarter in range
 static const uint64 FirstQuarter = (TopValue/4+1);
 
@@ -72,12 +220,205 @@ static const uint64 Half = (2*FirstQuarter);
 // Point after third quarter in range
 static const uint64 ThirdQuarter = (3*FirstQuarter);
 
+
+// Buckets of kick chain lengths in powers of two
+static const int KickBuckets = 16;
+
+// Phases of profile
+enum phase {
+	PhaseDist, PhaseUpdate, PhaseCode, PhaseChecksum, PhaseReset,
+	PhaseRescale, PhaseBootstrap, PhaseGrow, PhaseInput, PhaseOutput, Phases
+};
+
+// Counters of compression or decompression. Counters other than
+// resets, rescales and bootstraps are kept only when built with STATS.
+struct stats {
+	// Sample cycles of phases (set before compressing or decompressing)
+	bool profiling;
+	// Bytes compressed or decompressed
+	uint64 bytes;
+	// Cycles of each phase and in total when profiling
+	uint64 cycles[ Phases ];
+	uint64 cycles_total;
+	// Model resets on memory limit
+	uint64 resets;
+	// Model rescales
+	uint64 rescales;
+	// Bootstraps after reset
+	uint64 bootstraps;
+#ifdef STATS
+	// Slots probed by hash lookups and hits in h1 and h2 slot
+	uint64 probes;
+	uint64 hits_h1;
+	uint64 hits_h2;
+	// Insertions by kick chain length: 0, 1, 2-3, 4-7, ...
+	uint64 kicks[ KickBuckets ];
+	// Escapes from and symbols coded in each order from -1th
+	uint64 escapes[ OrderMax + 2 ];
+	uint64 coded[ OrderMax + 2 ];
+	// Hits and misses of long match prediction
+	uint64 match_hits;
+	uint64 match_misses;
+	// Orders passed over by start order
+	uint64 skips;
+	// Distributions of each order from cache and built from table
+	uint64 cached[ OrderMax + 1 ];
+	uint64 uncached[ OrderMax + 1 ];
+	// Rescales by cause
+	uint64 rescales_maxfreq;
+	uint64 rescales_coder;
+	uint64 rescales_adapt;
+	// Doublings of context table length
+	uint64 grows;
+	// Resets by cause
+	uint64 resets_maxloop;
+	uint64 resets_followers;
+	// Time spent in bootstraps
+	double bootstrap_seconds;
+#endif
+
+	stats() { memset(this, 0, sizeof(stats)); }
+
+	// Add counters of other
+	void add(const stats& o) {
+		bytes += o.bytes;
+		for (int i = 0 ; i < Phases ; ++i)
+			cycles[i] += o.cycles[i];
+		cycles_total += o.cycles_total;
+		resets += o.resets;
+		rescales += o.rescales;
+		bootstraps += o.bootstraps;
+#ifdef STATS
+		probes += o.probes;
+		hits_h1 += o.hits_h1;
+		hits_h2 += o.hits_h2;
+		for (int i = 0 ; i < KickBuckets ; ++i)
+			kicks[i] += o.kicks[i];
+		for (int i = 0 ; i < OrderMax + 2 ; ++i) {
+			escapes[i] += o.escapes[i];
+			coded[i] += o.coded[i];
+		}
+		match_hits += o.match_hits;
+		match_misses += o.match_misses;
+		skips += o.skips;
+		for (int i = 0 ; i <= OrderMax ; ++i) {
+			cached[i] += o.cached[i];
+			uncached[i] += o.uncached[i];
+		}
+		rescales_maxfreq += o.rescales_maxfreq;
+		rescales_coder += o.rescales_coder;
+		rescales_adapt += o.rescales_adapt;
+		grows += o.grows;
+		resets_maxloop += o.resets_maxloop;
+		resets_followers += o.resets_followers;
+		bootstrap_seconds += o.bootstrap_seconds;
+#endif
+	}
+};
+
+// Write counters as JSON object
+void report(std::ostream&, const stats&);
+
+// Write cycles per byte of phases with label
+void report_profile(std::ostream&, const stats&, const std::string&);
+
+// Decompress concatenated frames to stream, returns length or -1 on error
 long decompress(std::istream&, std::ostream&, std::ostream&);
 
-long compress(std::istream& in, std::ostream& out, std::ostream& err, 
-		const int, const int, const long, // order, limit, maxlen
-		const bool, const int, // reset, bootsize
-		const bool, const int); // adapt, adaptsize
+// Decompress concatenated frames adding to counters
+long decompress(std::istream&, std::ostream&, std::ostream&, stats&);
+
+// Decompress frame appended to string, returns length or -1 on error
+long decompress(std::istream&, std::string&, std::ostream&);
+
+// Compression options
+struct options {
+	// Model order
+	int order;
+	// Model memory limit in MiB
+	int limit;
+	// Stop after count bytes (0 is no limit)
+	long maxlen;
+	// Full reset model on memory limit instead of bootstrap
+	bool reset;
+	// Bootstrap buffer size in KiB
+	int bootsize;
+	// Fast local adaptation
+	bool adapt;
+	// Adaptation threshold in bits
+	int adaptsize;
+	// Sync flush point intervals (0 is no sync flush points)
+	long flushbytes;
+	long flushlines;
+	long flushms;
+	// Worker threads for many files
+	int jobs;
+	// Memory budget in MiB for models of all workers (0 is no limit)
+	long budget;
+	// Long-match model
+	bool longmatch;
+	// Start order skips orders with low hit rate
+	bool skip;
+	// Context table keeps 16-bit fingerprints of keys
+	bool fingerprint;
+	// Memory split to context tables by length of context
+	int split;
+	// Coding engine
+	int engine;
+	// Deduplication window in MiB (0 is no deduplication)
+	int dedupsize;
+	// Report hardware performance counters per byte
+	bool perf;
+	// Timeline trace file (empty is no trace) and bytes between records
+	std::string trace;
+	long tracebytes;
+	// Choose order and adaptation by trial compressions of a sample
+	bool autotune;
+	// Least MB/s of chosen settings (0 is smallest output)
+	double target;
+
+	options()
+		: order(OrderDefault), limit(LimitDefault), maxlen(CountDefault),
+		  reset(false), bootsize(BootDefault), 
+		  adapt(false), adaptsize(AdaptDefault),
+		  flushbytes(FlushDefault), flushlines(FlushDefault), 
+		  flushms(FlushDefault), jobs(JobsDefault), budget(BudgetDefault),
+		  longmatch(false), skip(false), fingerprint(false), 
+		  split(SplitShared), engine(EnginePPM), dedupsize(DedupDefault), perf(false), 
+		  tracebytes(TraceDefault), autotune(false), target(0)
+	{}
+};
+
+// Compress input to frame, returns length or -1 on error
+long compress(std::istream&, std::ostream&, std::ostream&, const options&);
+
+// Compress input to frame adding to counters
+long compress(std::istream&, std::ostream&, std::ostream&, const options&, 
+		stats&);
+
+// Model after priming data, shared read-only by messages
+class snapshot;
+
+// Snapshot of model after compressing priming data
+std::shared_ptr<const snapshot> prime(std::istream&, const options&);
+
+// Compress message starting from snapshot, appending code and checksum
+// without frame to string, returns length of code
+long compress(const snapshot&, const char *, const size_t, std::string&);
+
+// Decompress message starting from snapshot, appending to string, 
+// returns length or -1 on error
+long decompress(const snapshot&, const char *, const size_t, std::string&);
+
+// Compress each file to file.pim or all files to archive of named
+// frames, returns count of failed files
+int compress_files(const std::vector<std::string>&, const std::string&, 
+		const options&, std::ostream&, stats&);
+
+// Decompress each file.pim to file or all frames in archive to files
+// by stored names, returns count of failed files
+int decompress_files(const std::vector<std::string>&, const std::string&, 
+		const options&, std::ostream&, stats&);
 
 
 } // namespace
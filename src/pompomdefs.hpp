@@ -11,6 +11,13 @@
 #define L(x) ((int)x)
 #define R(x) ((int)x+1)
 
+// Hot path counters, compiled out without STATS
+#ifdef STATS
+#define STAT(x) x
+#else
+#define STAT(x)
+#endif
+
 namespace pompom {
 
 // Common typedefs for different sizes of integers 
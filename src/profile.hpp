@@ -0,0 +1,139 @@
+/**
+ * Cycle accounting of compression phases with the time stamp counter.
+ * Phases run for every byte (dist, update, code, input) are timed for
+ * one byte in SampleRate and scaled. Rare phases (checksum of block,
+ * reset, rescale, bootstrap, output write) are timed every time, and
+ * their cycles are taken off the phases they are run within.
+ *
+ * Profile is active for the thread which has it in scope, so workers
+ * of many files each keep their own.
+ *
+ * @author jkataja
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <x86intrin.h>
+
+#include "pompom.hpp"
+#include "pompomdefs.hpp"
+
+namespace pompom {
+
+class profile {
+public:
+	// Profile of this thread (0 is not profiling)
+	static __thread profile * active;
+
+	// Time stamp counter less cycles of rare phases
+	inline const uint64 clock() const;
+
+	// Next call of phase is sampled
+	inline const bool sample(const int);
+
+	// Add cycles of sampled call of phase
+	inline void add_sampled(const int, const uint64);
+
+	// Add cycles of rare phase
+	inline void add(const int, const uint64);
+
+	// Add cycles of phases and in total to counters
+	void collect(stats&) const;
+
+	profile();
+	~profile();
+
+	// Profile is active for thread while in scope (0 is no profile)
+	class scope {
+	public:
+		scope(profile * p) : prev(active) { active = p; }
+		~scope() { active = prev; }
+	private:
+		profile * prev;
+	};
+
+	// Cycles of rare phase while in scope, when profiling
+	class timer {
+	public:
+		inline timer(const int);
+		inline ~timer();
+	private:
+		profile * prof;
+		const int ph;
+		uint64 start;
+	};
+private:
+	profile(const profile&);
+	const profile& operator=(const profile&);
+
+	// Calls of each phase
+	uint32 calls[ Phases ];
+
+	// Cycles of each phase
+	uint64 cycles[ Phases ];
+
+	// Cycles of rare phases
+	uint64 rare;
+
+	// Time stamp counter at start
+	const uint64 begin;
+
+	// Cycles of reading the counter twice, taken off each sample
+	uint64 overhead;
+
+	// One in SampleRate calls is timed
+	static const uint32 SampleRate = 64;
+};
+
+__thread profile * profile::active = 0;
+
+profile::profile()
+	: rare(0), begin(__rdtsc())
+{
+	memset(calls, 0, sizeof(calls));
+	memset(cycles, 0, sizeof(cycles));
+	overhead = ~0ULL;
+	for (int i = 0 ; i < 64 ; ++i) {
+		uint64 t = clock();
+		overhead = std::min(overhead, clock() - t);
+	}
+}
+
+profile::~profile() {
+}
+
+const uint64 profile::clock() const {
+	return __rdtsc() - rare;
+}
+
+const bool profile::sample(const int ph) {
+	return ((++calls[ph] & (SampleRate - 1)) == 0);
+}
+
+void profile::add_sampled(const int ph, const uint64 n) {
+	cycles[ph] += (n > overhead ? n - overhead : 0) * SampleRate;
+}
+
+void profile::add(const int ph, const uint64 n) {
+	cycles[ph] += n;
+	rare += n;
+}
+
+void profile::collect(stats& st) const {
+	for (int i = 0 ; i < Phases ; ++i)
+		st.cycles[i] += cycles[i];
+	st.cycles_total += __rdtsc() - begin;
+}
+
+profile::timer::timer(const int phase)
+	: prof(active), ph(phase), start(prof ? prof->clock() : 0)
+{
+}
+
+profile::timer::~timer() {
+	if (prof)
+		prof->add(ph, prof->clock() - start);
+}
+
+} // namespace
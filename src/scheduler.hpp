@@ -0,0 +1,233 @@
+/**
+ * Worker pool with work stealing. Jobs are queued to workers round
+ * robin before running. Each worker takes jobs from the back of its
+ * own queue and when it is empty, steals from the front of the queues
+ * of other workers. Workers quit when all queues are empty, calling
+ * the exit job first, so a worker can release what it holds while
+ * others still run.
+ *
+ * Budget limits the memory reserved by all workers together. Worker
+ * waits until other workers have released enough of the budget.
+ *
+ * @author jkataja
+ */
+
+#pragma once
+
+#include <deque>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <stdexcept>
+
+#include "pompomdefs.hpp"
+
+namespace pompom {
+
+class scheduler {
+public:
+	// Job is called with index of worker
+	typedef std::function<void(const int)> job;
+
+	// Queue job to next worker
+	void add(const job&);
+
+	// Job called by each worker when it quits
+	void at_exit(const job&);
+
+	// Run all jobs and wait until done. Rethrows first exception of jobs.
+	void run();
+
+	// Count of workers
+	const int workers() const;
+
+	scheduler(const int);
+	~scheduler();
+private:
+	scheduler();
+	scheduler(const scheduler&);
+	const scheduler& operator=(const scheduler&);
+
+	struct queue {
+		std::mutex lock;
+		std::deque<job> jobs;
+	};
+
+	// Job queue for each worker
+	std::vector< std::unique_ptr<queue> > queues;
+
+	// Worker to queue next job
+	int next;
+
+	// Called by worker when it quits (empty is none)
+	job last;
+
+	// First exception thrown by a job
+	std::mutex error_lock;
+	std::exception_ptr error;
+
+	// Take job from own queue or steal from others
+	const bool take(const int, job&);
+
+	// Worker loop
+	void work(const int);
+};
+
+class budget {
+public:
+	// Wait until amount is available and reserve it
+	void acquire(const uint64);
+
+	// Reserve amount if it is available now, returns false otherwise
+	const bool try_acquire(const uint64);
+
+	// Release reserved amount
+	void release(const uint64);
+
+	budget(const uint64);
+	~budget();
+private:
+	budget();
+	budget(const budget&);
+	const budget& operator=(const budget&);
+
+	std::mutex lock;
+	std::condition_variable cond;
+
+	// Total amount and amount available
+	const uint64 total;
+	uint64 left;
+};
+
+scheduler::scheduler(const int n)
+	: next(0)
+{
+	if (n < 1) {
+		throw std::range_error("scheduler needs at least one worker");
+	}
+	for (int i = 0 ; i < n ; ++i)
+		queues.push_back(std::unique_ptr<queue>(new queue()));
+}
+
+scheduler::~scheduler() {
+}
+
+void scheduler::add(const job& j) {
+	queues[next]->jobs.push_back(j);
+	next = (next + 1) % queues.size();
+}
+
+void scheduler::at_exit(const job& j) {
+	last = j;
+}
+
+const int scheduler::workers() const {
+	return queues.size();
+}
+
+const bool scheduler::take(const int w, job& j) {
+	const int n = queues.size();
+
+	// Own queue from back
+	{
+		queue& q = *queues[w];
+		std::lock_guard<std::mutex> guard(q.lock);
+		if (!q.jobs.empty()) {
+			j = q.jobs.back();
+			q.jobs.pop_back();
+			return true;
+		}
+	}
+
+	// Steal from front of other queues
+	for (int i = 1 ; i < n ; ++i) {
+		queue& q = *queues[(w + i) % n];
+		std::lock_guard<std::mutex> guard(q.lock);
+		if (!q.jobs.empty()) {
+			j = q.jobs.front();
+			q.jobs.pop_front();
+			return true;
+		}
+	}
+
+	return false;
+}
+
+void scheduler::work(const int w) {
+	job j;
+	while (take(w, j)) {
+		try {
+			j(w);
+		}
+		catch (...) {
+			std::lock_guard<std::mutex> guard(error_lock);
+			if (!error)
+				error = std::current_exception();
+		}
+	}
+	if (!last)
+		return;
+	try {
+		last(w);
+	}
+	catch (...) {
+		std::lock_guard<std::mutex> guard(error_lock);
+		if (!error)
+			error = std::current_exception();
+	}
+}
+
+void scheduler::run() {
+	std::vector<std::thread> threads;
+	for (int w = 1 ; w < workers() ; ++w)
+		threads.push_back(std::thread(&scheduler::work, this, w));
+
+	// Calling thread is worker 0
+	work(0);
+
+	for (auto it = threads.begin() ; it != threads.end() ; ++it)
+		it->join();
+
+	if (error)
+		std::rethrow_exception(error);
+}
+
+budget::budget(const uint64 n)
+	: total(n), left(n)
+{
+}
+
+budget::~budget() {
+}
+
+void budget::acquire(const uint64 n) {
+	if (n > total) {
+		throw std::range_error("memory limit is larger than budget");
+	}
+	std::unique_lock<std::mutex> guard(lock);
+	while (left < n)
+		cond.wait(guard);
+	left -= n;
+}
+
+const bool budget::try_acquire(const uint64 n) {
+	std::lock_guard<std::mutex> guard(lock);
+	if (left < n)
+		return false;
+	left -= n;
+	return true;
+}
+
+void budget::release(const uint64 n) {
+	{
+		std::lock_guard<std::mutex> guard(lock);
+		left += n;
+	}
+	cond.notify_all();
+}
+
+} // namespace
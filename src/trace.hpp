@@ -0,0 +1,94 @@
+/**
+ * Timeline of compression: one tab separated record per interval of
+ * input bytes with input and output offsets, bpc and MB/s of the
+ * interval, load factor of the context table and counts of model
+ * resets, rescales and bootstraps so far. A record costs a clock
+ * read and a line of output, so tracing can be left on.
+ *
+ * @author jkataja
+ */
+
+#pragma once
+
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+
+#include "pompom.hpp"
+#include "model.hpp"
+
+namespace pompom {
+
+class trace {
+public:
+	// Record is due at input length
+	inline const bool due(const uint64) const;
+
+	// Write record at input and output length
+	void record(const uint64, const uint64, const model *);
+
+	// Write last record unless written at the same length
+	void finish(const uint64, const uint64, const model *);
+
+	trace(std::ostream&, const uint64);
+	~trace();
+private:
+	trace();
+	trace(const trace&);
+	const trace& operator=(const trace&);
+
+	std::ostream& out;
+
+	// Input bytes between records
+	const uint64 interval;
+
+	// Input length of next record
+	uint64 next;
+
+	// Input and output length and time of last record
+	uint64 lastin;
+	uint64 lastout;
+	std::chrono::steady_clock::time_point lasttime;
+};
+
+trace::trace(std::ostream& proxy, const uint64 n)
+	: out(proxy), interval(n > 0 ? n : 1), next(interval),
+	  lastin(0), lastout(0), lasttime(std::chrono::steady_clock::now())
+{
+	out << "#in\tout\tbpc\tMB/s\tload\tresets\trescales\tbootstraps"
+		<< std::endl;
+}
+
+trace::~trace() {
+}
+
+const bool trace::due(const uint64 len) const {
+	return (len >= next);
+}
+
+void trace::record(const uint64 len, const uint64 outlen, const model * m) {
+	auto now = std::chrono::steady_clock::now();
+	double sec = std::chrono::duration<double>(now - lasttime).count();
+	uint64 in = len - lastin;
+	stats st = m->counters();
+
+	out << len << "\t" << outlen << "\t" << std::fixed
+		<< std::setprecision(3)
+		<< (in > 0 ? (outlen - lastout) * 8.0 / in : 0.0) << "\t"
+		<< (sec > 0 ? in / sec / 1e6 : 0.0) << "\t"
+		<< std::setprecision(4) << m->load() << "\t"
+		<< st.resets << "\t" << st.rescales << "\t" << st.bootstraps
+		<< std::endl;
+
+	lastin = len;
+	lastout = outlen;
+	lasttime = now;
+	next = len + interval;
+}
+
+void trace::finish(const uint64 len, const uint64 outlen, const model * m) {
+	if (len > lastin || len == 0)
+		record(len, outlen, m);
+}
+
+} // namespace
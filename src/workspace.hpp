@@ -0,0 +1,160 @@
+/**
+ * Model kept alive between frames, so many small files don't each
+ * pay for allocating the model. The model is cleared and reused when
+ * the next frame has the same parameters and replaced otherwise.
+ * Memory limit of the model and memory of the window of dedup stage
+ * are reserved from a shared budget. Both are reserved at once when
+ * the model is taken, so a worker never waits for memory while it
+ * holds some, which could leave all workers waiting on each other.
+ *
+ * @author jkataja
+ */
+
+#pragma once
+
+#include <memory>
+
+#include "pompom.hpp"
+#include "model.hpp"
+#include "dedup.hpp"
+#include "scheduler.hpp"
+
+namespace pompom {
+
+class workspace {
+public:
+	// Model in clean state with the arguments and MiB reserved for the
+	// window of dedup stage (0 is none), window of previous frame is
+	// released
+	model * get(const int, const int, const bool, const int, const bool, const int, const bool, const bool, const bool, const bool, const bool, const int, const int, const int);
+
+	// Count of models allocated
+	const uint64 allocs() const;
+
+	// Count of models reused
+	const uint64 reuses() const;
+
+	// Window of dedup stage of MiB in clean state, parsing input or not;
+	// memory reserved with the model is used when it is enough
+	dedup * window(const int, const bool);
+
+	// Release model, window and their budget
+	void drop();
+
+	workspace(budget *);
+	~workspace();
+private:
+	workspace();
+	workspace(const workspace&);
+	const workspace& operator=(const workspace&);
+
+	// Release window and its reserved budget
+	void drop_window();
+
+	std::unique_ptr<model> m;
+
+	// Window of dedup stage and MiB reserved for it, whether or not it
+	// is allocated
+	std::unique_ptr<dedup> dd;
+	int ddmem;
+
+	// Shared memory budget (0 is no budget)
+	budget * mem;
+
+	uint64 alloclen;
+	uint64 reuselen;
+};
+
+workspace::workspace(budget * shared)
+	: ddmem(0), mem(shared), alloclen(0), reuselen(0)
+{
+}
+
+workspace::~workspace() {
+	drop();
+}
+
+model * workspace::get(const int ord, const int lim,
+		const bool reset, const int bootsize,
+		const bool adapt, const int adaptsize, const bool sync,
+		const bool longmatch, const bool skip, const bool grow,
+		const bool fingerprint, const int split, const int engine,
+		const int window)
+{
+	drop_window();
+
+	// Model is reused when memory of window is available next to it,
+	// otherwise it is released before waiting
+	if (m && m->matches(ord, lim, reset, bootsize, adapt, adaptsize, sync,
+				longmatch, skip, grow, fingerprint, split, engine)
+			&& (!mem || window == 0 || mem->try_acquire(window))) {
+		ddmem = window;
+		m->clear();
+		++reuselen;
+		return m.get();
+	}
+
+	if (m && mem)
+		mem->release(m->limit);
+	m.reset();
+	if (mem)
+		mem->acquire(lim + window);
+	ddmem = window;
+	try {
+		m.reset( model::instance(ord, lim, reset, bootsize,
+				adapt, adaptsize, sync, longmatch, skip, grow,
+				fingerprint, split, engine) );
+	}
+	catch (...) {
+		if (mem)
+			mem->release(lim);
+		drop_window();
+		throw;
+	}
+	++alloclen;
+	return m.get();
+}
+
+dedup * workspace::window(const int size, const bool parse) {
+	// Window is not cleared, so it is allocated again
+	dd.reset();
+	const int need = dedup::footprint(size, parse);
+	if (ddmem != need) {
+		drop_window();
+		if (mem)
+			mem->acquire(need);
+		ddmem = need;
+	}
+	try {
+		dd.reset(new dedup(size, parse));
+	}
+	catch (...) {
+		drop_window();
+		throw;
+	}
+	return dd.get();
+}
+
+void workspace::drop() {
+	if (m && mem)
+		mem->release(m->limit);
+	m.reset();
+	drop_window();
+}
+
+void workspace::drop_window() {
+	if (ddmem > 0 && mem)
+		mem->release(ddmem);
+	ddmem = 0;
+	dd.reset();
+}
+
+const uint64 workspace::allocs() const {
+	return alloclen;
+}
+
+const uint64 workspace::reuses() const {
+	return reuselen;
+}
+
+} // namespace
@@ -0,0 +1,67 @@
+/**
+ * Decompression of corrupt frames. Each case writes a frame by hand
+ * which the compressor would never output, and expects decompression to
+ * fail with an error instead of running on the corrupt values.
+ *
+ * @author jkataja
+ */
+
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <stdexcept>
+
+#include "../src/pompom.cpp"
+
+using namespace pompom;
+
+// Decompress frame, returns message of error or empty if none
+static std::string error_of(const std::string& data) {
+	std::istringstream in(data);
+	std::ostringstream out;
+	std::ostringstream err;
+	try {
+		if (decompress(in, out, err) < 0)
+			return err.str();
+	}
+	catch (std::exception& e) {
+		return e.what();
+	}
+	return "";
+}
+
+// Frame with dedup window which starts with reference of length n
+static std::string dedup_frame(const uint64 n) {
+	std::ostringstream out;
+	frame f;
+	f.dedupsize = 1;
+	f.write_header(out);
+	dedup dd(f.dedupsize, false);
+	encoder enc(out);
+	enc.encode_bit(true, dd.reffreq());
+	enc.encode_int(1);
+	enc.encode_int(n);
+	enc.finish();
+	return out.str();
+}
+
+static int check(const char * name, const std::string& data,
+		const std::string& expect)
+{
+	const std::string e = error_of(data);
+	const bool ok = (e.find(expect) != std::string::npos);
+	std::cout << (ok ? "ok   " : "FAIL ") << name;
+	if (!ok)
+		std::cout << ": expected \"" << expect << "\" got \"" << e << "\"";
+	std::cout << std::endl;
+	return (ok ? 0 : 1);
+}
+
+int main() {
+	int failed = 0;
+	failed += check("dedup reference of 2^40 bytes",
+			dedup_frame((uint64)1 << 40), "reference length out of range");
+	failed += check("dedup reference shorter than DedupMin",
+			dedup_frame(DedupMin - 1), "reference length out of range");
+	return (failed > 0 ? 1 : 0);
+}
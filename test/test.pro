@@ -0,0 +1,8 @@
+TEMPLATE = app
+CONFIG = console warn_on release
+SOURCES = corrupt.cpp
+TARGET = pompom-test
+DESTDIR = ../bin
+LIBS = -lboost_system -lpthread -lm
+
+include(../common.pri)